@@ -4,95 +4,436 @@
 #include <math.h>
 #include <unistd.h>
 #include <cstring>
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include "common.h"
 #include "mtmd-helper.h"
+#include "trace.h"
 
 #define TAG "llama-linux.cpp"
 #define LOGi(...) printf(__VA_ARGS__); printf("\n")
 #define LOGe(...) printf(__VA_ARGS__); printf("\n")
 
-LLM::LLM() : model(nullptr), context(nullptr), batch(nullptr), sampler(nullptr), prev_tokens_len(0), chat_history_tokens_len(0) {}
+LLM::LLM() : model(nullptr), context(nullptr), batch(nullptr), n_batch(512), n_ctx_slot(2048), context_shift(true), backend_ready(false),
+             threadpool(nullptr), threadpool_batch(nullptr), threadpool_mode(-1), threadpools_paused(false),
+             draft_model(nullptr), draft_context(nullptr), draft_batch(nullptr), think_start(LLAMA_TOKEN_NULL),
+             think_end(LLAMA_TOKEN_NULL), active_lora(-1), lora_steps(0),
+             running(false), n_pending(0) {}
 
 LLM::~LLM() {
     unload();
 }
 
-bool LLM::load(const std::string& model_path, const std::string& mmproj_path, int gpu_layers) {
-    backend_init();
+bool LLM::load(const std::string& model_path, const std::string& mmproj_path, int gpu_layers, int n_parallel, const std::string& draft_model_path) {
+    LLMConfig config;
+    config.model_path = model_path;
+    config.mmproj_path = mmproj_path;
+    config.gpu_layers = gpu_layers;
+    config.n_parallel = n_parallel;
+    config.draft_model_path = draft_model_path;
+    return load(config);
+}
+
+bool LLM::load(const LLMConfig& config) {
+    std::string error;
+    if (!config.validate(error)) {
+        LOGe("load(): %s", error.c_str());
+        return false;
+    }
+    this->config = config;
+    n_batch = config.n_batch;
+    n_ctx_slot = config.n_ctx;
+    context_shift = config.context_shift;
+
+    if (!backend_ready) {
+        backend_init();
+        backend_ready = true;
+    }
     log_to_console();
 
     llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = gpu_layers;
+    model_params.n_gpu_layers = config.gpu_layers;
+    model_params.use_mmap = config.use_mmap;
 
-    model = llama_model_load_from_file(model_path.c_str(), model_params);
+    model = llama_model_load_from_file(config.model_path.c_str(), model_params);
     if (!model) {
         LOGe("load_model() failed");
         return false;
     }
+    if (!config.lora.empty() && !load_adapters(config.lora)) {
+        LLM::free_model(model);
+        model = nullptr;
+        return false;
+    }
 
-    if (!mmproj_path.empty()) {
-        init_vision_context(mmproj_path.c_str(), gpu_layers, model, 0);
+    if (!config.mmproj_path.empty()) {
+        vision_cache.set_budget(config.vision_cache_bytes);
+        init_vision_context(config.mmproj_path.c_str(), config.gpu_layers, model, 0);
+        image_pool.start(std::max(1, std::min(4, config.threads_batch() / 4)), "image");
+        encode_pool.start(1, "vision");
     }
 
-    context = LLM::new_context(model);
+    // Every slot owns one sequence, the KV cache is sized so each of them gets n_ctx_slot cells.
+    // A scheduler step decodes at most n_batch tokens, split into ubatches of n_ubatch
+    const int n_parallel = config.n_parallel;
+    const uint64_t kv_budget = config.kv_budget > 0 ? config.kv_budget : KVMemory::available_bytes();
+    context = LLM::new_context(model, config);
     if (!context) {
         LLM::free_model(model);
+        model = nullptr;
         return false;
     }
 
-    batch = LLM::new_batch(512, 0, 1);
-    sampler = LLM::new_sampler();
+    batch = LLM::new_batch(n_batch, 0, 1);
+
+    // Embeddings run on the caller's thread in embed(), there is no scheduler
+    if (config.embedding) {
+        if (!new_threadpools()) {
+            LOGe("using the implicit threadpools of llama.cpp");
+        }
+        LOGi("embeddings mode: %d dimensions, pooling %d, batches of %d tokens in %d sequences",
+             llama_model_n_embd(model), llama_pooling_type(context), n_batch, n_parallel);
+        return true;
+    }
+
+    // Reasoning controls need <think> and </think> as single tokens of the vocabulary
+    auto single_token = [this](const char* text) {
+        auto tokens = common_tokenize(llama_model_get_vocab(model), text, false, true);
+        return tokens.size() == 1 ? tokens[0] : LLAMA_TOKEN_NULL;
+    };
+    think_start = single_token("<think>");
+    think_end = single_token("</think>");
+    if (think_start == LLAMA_TOKEN_NULL || think_end == LLAMA_TOKEN_NULL) {
+        think_start = think_end = LLAMA_TOKEN_NULL;
+    }
+
+    pieces.build(llama_model_get_vocab(model));
+    LOGi("piece cache: %d tokens, %zu bytes", llama_vocab_n_tokens(llama_model_get_vocab(model)), pieces.n_bytes());
+
+    if (!config.draft_model_path.empty() && !load_draft()) {
+        LOGe("speculative decoding disabled");
+    }
+
+    kv_memory_info = KVMemory::compute(model, draft_model, config, kv_budget);
+    LOGi("%s", kv_memory_info.summary().c_str());
+    if (kv_memory_info.max_sessions < n_parallel) {
+        LOGe("warning: %d sessions configured but only %d fit in the KV budget", n_parallel, kv_memory_info.max_sessions);
+    }
+
+    if (!new_threadpools()) {
+        LOGe("using the implicit threadpools of llama.cpp");
+    }
+
+    slots.resize(n_parallel);
+    for (int i = 0; i < n_parallel; i++) {
+        slots[i].id = i;
+    }
+
+    running = true;
+    worker = std::thread(&LLM::loop, this);
+    LOGi("scheduler started: %d slots, %d ctx tokens per slot, batch %d/%d, %d decode / %d prefill threads",
+         n_parallel, n_ctx_slot, n_batch, config.n_ubatch, config.threads(), config.threads_batch());
 
     return true;
 }
 
 void LLM::unload() {
-    if (sampler) {
-        LLM::free_sampler(sampler);
-        sampler = nullptr;
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            running = false;
+        }
+        queue_cv.notify_all();
+        worker.join();
     }
+    image_pool.stop();
+    encode_pool.stop();
+    snapshots.close();
+    for (auto& slot : slots) {
+        if (slot.sampler) {
+            LLM::free_sampler(slot.sampler);
+            slot.sampler = nullptr;
+        }
+    }
+    slots.clear();
+    for (auto& entry : grammar_cache) {
+        LLM::free_sampler(entry.second);
+    }
+    grammar_cache.clear();
+    for (auto& entry : sampler_pool) {
+        for (llama_sampler* sampler : entry.second) {
+            LLM::free_sampler(sampler);
+        }
+    }
+    sampler_pool.clear();
+    conversations.clear();
     if (batch) {
         LLM::free_batch(batch);
         batch = nullptr;
     }
+    if (draft_batch) {
+        LLM::free_batch(draft_batch);
+        draft_batch = nullptr;
+    }
+    if (draft_context) {
+        LLM::free_context(draft_context);
+        draft_context = nullptr;
+    }
+    if (draft_model) {
+        LLM::free_model(draft_model);
+        draft_model = nullptr;
+    }
     if (context) {
         LLM::free_context(context);
         context = nullptr;
     }
+    // Freed with the model
+    adapters.clear();
+    active_lora = -1;
     if (model) {
         LLM::free_model(model);
         model = nullptr;
     }
-    backend_free();
+    // The contexts using them are gone
+    if (threadpool) {
+        ggml_threadpool_free(threadpool);
+        threadpool = nullptr;
+    }
+    if (threadpool_batch) {
+        ggml_threadpool_free(threadpool_batch);
+        threadpool_batch = nullptr;
+    }
+    threadpool_mode = -1;
+    threadpools_paused = false;
+    if (backend_ready) {
+        backend_free();
+        backend_ready = false;
+    }
 }
 
-std::string LLM::send(const std::string& user_input, const std::string& image_path) {
-    int n_len = 1280;
-    fprintf(stdout, "sending to model...\n");
+uint64_t LLM::memory_bytes() const {
+    uint64_t bytes = kv_memory_info.allocated_bytes;
+    if (model) {
+        bytes += llama_model_size(model);
+    }
+    if (draft_model) {
+        bytes += llama_model_size(draft_model);
+    }
+    return bytes;
+}
+
+std::vector<std::string> LLM::lora_names() const {
+    std::vector<std::string> names;
+    for (const auto& adapter : adapters) {
+        names.push_back(adapter.name);
+    }
+    return names;
+}
+
+bool LLM::load_adapters(const std::string& manifest) {
+    // {"adapters": {"sql": {"path": "sql-lora.gguf", "scale": 1.0}, "search": "search-lora.gguf"}}
+    nlohmann::json j;
+    try {
+        std::ifstream in(manifest);
+        if (!in) {
+            LOGe("load_adapters(): cannot open %s", manifest.c_str());
+            return false;
+        }
+        j = nlohmann::json::parse(in).at("adapters");
+        for (const auto& item : j.items()) {
+            const bool plain = item.value().is_string();
+            const std::string path = plain ? item.value().get<std::string>() : item.value().at("path").get<std::string>();
+            const float scale = plain ? 1.0f : item.value().value("scale", 1.0f);
+            llama_adapter_lora* adapter = llama_adapter_lora_init(model, path.c_str());
+            if (!adapter) {
+                LOGe("load_adapters(): cannot load %s from %s", item.key().c_str(), path.c_str());
+                return false;
+            }
+            adapters.push_back({item.key(), adapter, scale});
+            LOGi("lora adapter %s: %s, scale %.2f", item.key().c_str(), path.c_str(), scale);
+        }
+    } catch (const std::exception& e) {
+        LOGe("load_adapters(): %s: %s", manifest.c_str(), e.what());
+        return false;
+    }
+    return true;
+}
 
-    // if (check_vision_ready()) {
-    //     fprintf(stdout, "Vision model is ready\n");
-    //     completion_init_vision(user_input.c_str(), true, n_len, image_path.c_str());
-    // } else {
-    //     fprintf(stdout, "Vision model is not ready\n");
-    //     completion_init(user_input.c_str(), true, n_len);
-    // }
-    completion_init(user_input.c_str(), true, n_len);
+bool LLM::embed(const std::vector<std::string>& inputs, std::vector<std::vector<float>>& embeddings, int& n_tokens, std::string& error, bool& bad_request) {
+    if (!context) {
+        error = "the model is not loaded";
+        bad_request = false;
+        return false;
+    }
+    if (!config.embedding) {
+        error = "the model is not loaded in embeddings mode";
+        bad_request = true;
+        return false;
+    }
 
-    std::string result = "";
-    for (int i = 0; i < n_len; i++) {
-        std::string token = completion_loop(n_len);
-        if (token.empty()) {
-            break;
+    std::vector<std::vector<llama_token>> tokens(inputs.size());
+    n_tokens = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        tokens[i] = common_tokenize(context, inputs[i], true, true);
+        if (tokens[i].empty() || (int) tokens[i].size() > n_batch) {
+            error = "input " + std::to_string(i) + " has " + std::to_string(tokens[i].size()) +
+                    " tokens, it must have between 1 and " + std::to_string(n_batch);
+            bad_request = true;
+            return false;
         }
-        result += token;
+        n_tokens += tokens[i].size();
     }
 
-    supply(result.c_str());
+    std::lock_guard<std::mutex> lock(embed_mutex);
+    const int n_embd = llama_model_n_embd(model);
+    const bool encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+    const int64_t t_start = llama_time_us();
+    embeddings.assign(inputs.size(), std::vector<float>(n_embd));
+    pause_threadpools(false);
+
+    // As many inputs per batch as fit, each in its own sequence and pooled separately
+    int n_batches = 0;
+    bool ok = true;
+    for (size_t first = 0; ok && first < inputs.size(); n_batches++) {
+        common_batch_clear(*batch);
+        size_t last = first;
+        while (last < inputs.size() && (int) (last - first) < config.n_parallel &&
+               batch->n_tokens + (int) tokens[last].size() <= n_batch) {
+            const llama_seq_id seq = last - first;
+            for (size_t pos = 0; pos < tokens[last].size(); pos++) {
+                common_batch_add(*batch, tokens[last][pos], pos, { seq }, true);
+            }
+            last++;
+        }
 
-    return result;
+        llama_memory_t mem = llama_get_memory(context);
+        if (mem) {
+            llama_memory_clear(mem, true);
+        }
+        ok = (encoder_only ? llama_encode(context, *batch) : llama_decode(context, *batch)) == 0;
+        for (size_t i = first; ok && i < last; i++) {
+            const float* embd = llama_get_embeddings_seq(context, i - first);
+            ok = embd != nullptr;
+            if (ok) {
+                common_embd_normalize(embd, embeddings[i].data(), n_embd, 2);
+            }
+        }
+        first = last;
+    }
+    pause_threadpools(true);
+
+    if (!ok) {
+        error = "failed to compute the embeddings";
+        bad_request = false;
+        return false;
+    }
+    const double seconds = (llama_time_us() - t_start) / 1e6;
+    LOGi("embeddings: %zu inputs, %d tokens, %d batches in %.1f ms, %.1f embeddings/s", inputs.size(), n_tokens,
+         n_batches, seconds * 1e3, inputs.size() / seconds);
+    return true;
+}
+
+bool LLM::enable_snapshots(const std::string& dir, uint64_t max_bytes) {
+    // A sequence never holds more than a slot's tokens, nor more state than their K and V
+    snapshots.set_limits(n_ctx_slot, kv_memory_info.bytes_per_token + 64);
+    return snapshots.open(dir, max_bytes, [this] { notify_scheduler(); });
+}
+
+std::string LLM::send(const std::string& user_input, const std::string& image_path, const std::string& conversation_id, const Options& options) {
+    return send_async(user_input, nullptr, image_path, conversation_id, options).get().content;
 }
 
+std::string LLM::send_stream(const std::string& user_input, const TokenCallback& on_token, const std::string& image_path, const std::string& conversation_id, const Options& options) {
+    return send_async(user_input, on_token, image_path, conversation_id, options).get().content;
+}
+
+std::future<LLM::Result> LLM::send_async(const std::string& user_input, TokenCallback on_token, const std::string& image_path, const std::string& conversation_id, const Options& options) {
+    auto task = std::make_shared<Task>();
+    task->user_input = user_input;
+    task->image_path = image_path;
+    task->conversation_id = conversation_id;
+    task->n_len = options.max_tokens > 0 ? options.max_tokens : 1280;
+    task->t_deadline = options.timeout_ms > 0 ? llama_time_us() + options.timeout_ms * 1000 : 0;
+    task->options = options;
+    task->on_token = std::move(on_token);
+    // An empty stop string would end every generation before its first token
+    auto& stop = task->options.stop;
+    stop.erase(std::remove(stop.begin(), stop.end(), std::string()), stop.end());
+    std::future<Result> result = task->result.get_future();
+
+    if (!options.lora.empty()) {
+        for (size_t i = 0; i < adapters.size(); i++) {
+            if (adapters[i].name == options.lora) {
+                task->lora = i;
+                break;
+            }
+        }
+        if (task->lora < 0) {
+            LOGe("send(): no lora adapter named %s", options.lora.c_str());
+            task->result.set_value(error_result("no lora adapter named " + options.lora, true));
+            return result;
+        }
+    }
+
+    // Images are decoded on the pool right away, each in its own job, and the job finishing last
+    // tokenizes them all. The request waits in the queue until they are ready, so neither a large
+    // image nor its preprocessing ever stalls the scheduler
+    const size_t n_images = options.images.size() + !image_path.empty();
+    if (n_images > 0 && !ctx_vision) {
+        LOGe("send(): no vision model loaded for %zu images", n_images);
+        task->result.set_value(error_result("images need a vision model, none is loaded", true));
+        return result;
+    }
+    if (n_images > 0) {
+        struct Pending {
+            std::vector<mtmd::bitmap> bitmaps;
+            std::atomic<size_t> n_left;
+            std::promise<std::shared_ptr<PreparedMedia>> prepared;
+        };
+        auto pending = std::make_shared<Pending>();
+        pending->bitmaps.resize(n_images);
+        pending->n_left = n_images;
+        task->media = pending->prepared.get_future();
+        for (size_t i = 0; i < n_images; i++) {
+            image_pool.submit([this, task, i, pending] {
+                mtmd::bitmap& bmp = pending->bitmaps[i];
+                if (i < task->options.images.size()) {
+                    const std::string& data = task->options.images[i];
+                    bmp.ptr.reset(mtmd_helper_bitmap_init_from_buf(ctx_vision.get(), (const unsigned char*) data.data(), data.size()));
+                } else {
+                    bmp.ptr.reset(mtmd_helper_bitmap_init_from_file(ctx_vision.get(), task->image_path.c_str()));
+                }
+                // The image chunk made from this bitmap gets the same id, the key of its cached embedding
+                if (bmp.ptr) {
+                    bmp.set_id(VisionCache::key(bmp.ptr.get()).c_str());
+                }
+                if (--pending->n_left == 0) {
+                    pending->prepared.set_value(prepare_media(pending->bitmaps));
+                    notify_scheduler();
+                }
+            });
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (!running) {
+            const char* error = config.embedding ? "the model is loaded in embeddings mode" : "the model is not loaded";
+            LOGe("send(): %s", error);
+            task->result.set_value(error_result(error, false));
+            return result;
+        }
+        queue.push_back(task);
+        n_events++;
+        n_pending++;
+    }
+    queue_cv.notify_one();
+    fprintf(stdout, "sending to model...\n");
+
+    return result;
+}
 
 void LLM::init_vision_context(const char * mmprojPath,int gpu,llama_model * model,int verbosity) {
     mtmd_context_params mparams = mtmd_context_params_default();
@@ -100,7 +441,7 @@ void LLM::init_vision_context(const char * mmprojPath,int gpu,llama_model * mode
     if(gpu==0) useGPU = false;
     mparams.use_gpu = useGPU;
     mparams.print_timings = true;
-    int n_threads = std::max(1, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
+    int n_threads = config.threads_batch();
     LOGi("mmproj model Using %d threads", n_threads);
     mparams.n_threads = n_threads;
     mparams.verbosity = verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
@@ -112,245 +453,1452 @@ void LLM::init_vision_context(const char * mmprojPath,int gpu,llama_model * mode
     }
 }
 
-bool LLM::load_media(const char * fname) {
-    if (!ctx_vision.get()) {
-        LOGe("Failed to load vision model, load_media failed\n");
+std::shared_ptr<LLM::PreparedMedia> LLM::prepare_media(std::vector<mtmd::bitmap>& images) {
+    // The chat content has no markers, the images and their wrapper tokens are tokenized on their
+    // own and inserted in front of the user's text
+    auto prepared = std::make_shared<PreparedMedia>();
+    mtmd::bitmaps bitmaps;
+    std::string markers;
+    for (auto& bmp : images) {
+        if (!bmp.ptr) {
+            LOGe("cannot decode an image of the request");
+            return prepared;
+        }
+        bitmaps.entries.push_back(std::move(bmp));
+        markers += mtmd_default_marker();
+    }
+
+    mtmd_input_text text;
+    text.text          = markers.c_str();
+    text.add_special   = false;
+    text.parse_special = true;
+    mtmd::input_chunks chunks(mtmd_input_chunks_init());
+    auto bitmaps_c_ptr = bitmaps.c_ptr();
+    int32_t res = mtmd_tokenize(ctx_vision.get(), chunks.ptr.get(), &text, bitmaps_c_ptr.data(), bitmaps_c_ptr.size());
+    if (res != 0) {
+        LOGe("mtmd_tokenize() failed, res = %d", res);
+        return prepared;
+    }
+
+    // An image takes n_pos placeholders, negative ids derived from its content hash: an image
+    // already in a sequence matches like any cached prefix, a different one does not. Models that
+    // slice an image make several chunks with the bitmap's id, the ordinal tells the slices apart
+    std::map<std::string, int> n_slices;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const mtmd_input_chunk* chunk = chunks[i];
+        if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            size_t n_tokens = 0;
+            const llama_token* text_tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+            prepared->tokens.insert(prepared->tokens.end(), text_tokens, text_tokens + n_tokens);
+            continue;
+        }
+        Media item;
+        item.pos = prepared->tokens.size();
+        item.n_pos = mtmd_input_chunk_get_n_pos(chunk);
+        item.chunk.reset(mtmd_input_chunk_copy(chunk), mtmd_input_chunk_free);
+        const char* id = mtmd_input_chunk_get_id(chunk);
+        const std::string image = id ? id : "";
+        if (!image.empty()) {
+            item.key = image + "#" + std::to_string(n_slices[image]++) + "/" + std::to_string(mtmd_input_chunk_get_n_tokens(chunk));
+        }
+        const llama_token placeholder = -2 - (llama_token) (std::hash<std::string>()(item.key) & 0x3fffffff);
+        prepared->tokens.insert(prepared->tokens.end(), item.n_pos, placeholder);
+        prepared->media.push_back(std::move(item));
+    }
+    prepared->ok = true;
+    return prepared;
+}
+
+void LLM::encode_media(Media& media) {
+    auto encoded = std::make_shared<std::promise<std::shared_ptr<const std::vector<float>>>>();
+    media.embd = encoded->get_future();
+    auto chunk = media.chunk;
+    const std::string key = media.key;
+    encode_pool.submit([this, chunk, key, encoded] {
+        const size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk.get());
+        trace::Scope<trace::LEVEL_REQUEST> span(trace::IMAGE_ENCODE, -1);
+        span.a = n_tokens;
+        std::shared_ptr<const std::vector<float>> embd = vision_cache.get(key);
+        span.b = embd != nullptr;
+        if (!embd) {
+            if (mtmd_encode_chunk(ctx_vision.get(), chunk.get()) == 0) {
+                const float* out = mtmd_get_output_embd(ctx_vision.get());
+                embd = std::make_shared<std::vector<float>>(out, out + (size_t) llama_model_n_embd(model) * n_tokens);
+                vision_cache.put(key, embd);
+            } else {
+                LOGe("mtmd_encode_chunk() failed for an image of %zu tokens", n_tokens);
+            }
+        }
+        encoded->set_value(std::move(embd));
+        notify_scheduler();
+    });
+}
+
+bool LLM::decode_media(Slot& slot) {
+    if (slot.state != SLOT_PREFILL || slot.media.empty() || slot.media.front().pos != slot.n_prompt_done) {
+        return false;
     }
-    mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(ctx_vision.get(), fname));
-    if (!bmp.ptr) {
+    Media& media = slot.media.front();
+    // Still being encoded, the other sequences go on without this one
+    if (media.embd.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
         return false;
     }
-    bitmaps.entries.push_back(std::move(bmp));
+
+    auto embd = media.embd.get();
+    llama_pos n_past = slot.n_past;
+    int32_t res = -1;
+    if (embd) {
+        trace::Scope<trace::LEVEL_STEP> span(trace::IMAGE_DECODE, slot.id);
+        span.a = media.n_pos;
+        span.b = slot.n_past;
+        use_threadpool(true);
+        res = mtmd_helper_decode_image_chunk(ctx_vision.get(), context, media.chunk.get(), const_cast<float*>(embd->data()),
+                                             slot.n_past, slot.id, n_batch, &n_past);
+    }
+    if (res != 0) {
+        llama_memory_seq_rm(llama_get_memory(context), slot.id, -1, -1);
+        slot.cache_tokens.clear();
+        fail_slot(slot, embd ? "cannot decode an image of the prompt" : "cannot encode an image of the prompt", false);
+        evict_slot(slot);
+        return true;
+    }
+
+    const auto first = slot.prompt_tokens.begin() + slot.n_prompt_done;
+    slot.cache_tokens.insert(slot.cache_tokens.end(), first, first + media.n_pos);
+    slot.n_prompt_done += media.n_pos;
+    slot.n_past = n_past;
+    slot.media.erase(slot.media.begin());
     return true;
 }
 
-bool LLM::check_vision_ready(){
-    return mtmd_support_vision(ctx_vision.get());
+void LLM::notify_scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        n_events++;
+    }
+    queue_cv.notify_one();
 }
 
-int LLM::completion_init_vision(const char* text, bool format_chat, int n_len, const char* picf) {
-    cached_token_chars.clear();
+bool LLM::has_work(const Slot& slot) const {
+    if (slot.state == SLOT_DECODE) {
+        return true;
+    }
+    if (slot.state != SLOT_PREFILL) {
+        return false;
+    }
+    return slot.media.empty() || slot.media.front().pos > slot.n_prompt_done
+        || slot.media.front().embd.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
 
-    std::vector<char> formatted(llama_n_ctx(context));
-    const auto model = llama_get_model(context);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
-    const char * tmpl = llama_model_chat_template(model, /* name */ nullptr);
-    std::string user_text(text);
-    if(picf !="" && load_media(picf)){
-        LOGi("pic %s loaded successfully",picf);
-        user_text = mtmd_default_marker() + user_text;
+// Steps an adapter keeps the context while slots of other adapters wait
+static const int LORA_STEPS = 16;
+
+void LLM::select_lora() {
+    if (adapters.empty()) {
+        return;
     }
-    messages.push_back({"user", strcpy(new char[user_text.length() + 1], user_text.c_str())});
-    int new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
-    if (new_len > (int)formatted.size()) {
-        formatted.resize(new_len);
-        new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
+    // Slots are grouped by adapter, the context switches only when the active group runs out of
+    // work or has had its share of steps. The next group with work is taken in turn, the base
+    // model (-1) included
+    const int n_groups = adapters.size() + 1;
+    std::vector<bool> ready(n_groups, false);
+    for (const auto& slot : slots) {
+        if (has_work(slot)) {
+            ready[slot.lora + 1] = true;
+        }
     }
-    if (new_len < 0) {
-        LOGe("failed to apply the chat template\n");
+    if (ready[active_lora + 1] && lora_steps < LORA_STEPS) {
+        lora_steps++;
+        return;
     }
-    std::string prompt(formatted.begin() + chat_history_tokens_len, formatted.begin() + new_len);
-    LOGi("Current Chat History (Size: %zu):", messages.size());
-    for (size_t i = 0; i < messages.size(); ++i) {
-        const llama_chat_message& msg_to_log = messages[i];
-        const char* role_to_log = msg_to_log.role ? msg_to_log.role : "[null role]";
-        const char* content_to_log = msg_to_log.content ? msg_to_log.content : "[null content]";
-        LOGi("  Msg %zu: Role: \"%s\", Content: \"%s\"", i, role_to_log, content_to_log);
+    for (int i = 1; i <= n_groups; i++) {
+        const int lora = (active_lora + 1 + i) % n_groups - 1;
+        if (!ready[lora + 1]) {
+            continue;
+        }
+        if (lora != active_lora) {
+            llama_clear_adapter_lora(context);
+            if (lora >= 0) {
+                llama_set_adapter_lora(context, adapters[lora].adapter, adapters[lora].scale);
+            }
+            LOGi("lora: switching to %s", lora >= 0 ? adapters[lora].name.c_str() : "the base model");
+            active_lora = lora;
+        }
+        lora_steps = 1;
+        return;
     }
+}
 
-    LOGi("prompt:%s",prompt.c_str());
+void LLM::loop() {
+    trace::set_thread_name("scheduler");
+    bool progress = false;
+    uint64_t n_seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            // Idle pool threads would keep polling for work, they sleep until the next request
+            if (queue.empty() && !has_active_slots()) {
+                pause_threadpools(true);
+            }
+            // A step that decoded nothing leaves nothing to do until a request arrives or an image
+            // of a waiting one is decoded or encoded
+            // Cancellations and deadlines do not notify, requests waiting for something are checked
+            // every 50 ms
+            auto wake = [&] { return !running || progress || n_events != n_seen; };
+            if (queue.empty() && !has_active_slots()) {
+                queue_cv.wait(lock, wake);
+            } else {
+                queue_cv.wait_for(lock, std::chrono::milliseconds(50), wake);
+            }
+            if (!running) {
+                break;
+            }
+            n_seen = n_events;
+        }
+        pause_threadpools(false);
+        cancel_tasks();
+        expire_conversations();
+        assign_tasks();
+        progress = update_slots();
+    }
 
-    bool parse_special = format_chat;
-    bool add_bos = true;
-    if(prev_tokens_len > 0){
-        add_bos = false;
+    // The context is going away, wake up everyone still waiting for a result
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    for (auto& slot : slots) {
+        if (slot.task) {
+            slot.finish_reason = "error";
+            slot.error = "the model was unloaded";
+            finish(*slot.task, slot_result(slot));
+            slot.task.reset();
+        }
+        slot.state = SLOT_IDLE;
+    }
+    for (auto& task : queue) {
+        finish(*task, error_result("the model was unloaded", false));
     }
-    LOGi("cpp:prev_tokens_len = %d, add_bos = %d",prev_tokens_len,add_bos);
+    queue.clear();
+}
 
-    mtmd_input_text mtmd_text;
-    mtmd_text.text          = prompt.c_str();
-    mtmd_text.add_special   = add_bos;
-    mtmd_text.parse_special = true;
-    int n_batch = 512;
-    mtmd::input_chunks chunks(mtmd_input_chunks_init());
-    auto bitmaps_c_ptr = bitmaps.c_ptr();
-    int32_t res = mtmd_tokenize(ctx_vision.get(),
-                                chunks.ptr.get(),
-                                &mtmd_text,
-                                bitmaps_c_ptr.data(),
-                                bitmaps_c_ptr.size());
-    if (res != 0) {
-        LOGe("mtmd Unable to tokenize prompt, res = %d\n", res);
-    }
-    LOGi("cpp: mtmd tokenized prompt, res = %d\n", res);
-
-    bitmaps.entries.clear();
-    llama_pos new_n_past;
-    LOGi("cpp: cleared bitmaps");
-
-    if (mtmd_helper_eval_chunks(ctx_vision.get(),
-                                context,
-                                chunks.ptr.get(),
-                                prev_tokens_len,
-                                0,
-                                n_batch,
-                                true,
-                                &new_n_past)) {
-        LOGe("Unable to eval prompt\n");
-    }
-    LOGi("cpp: evaluated prompt");
-
-    int prompt_token_len = new_n_past - prev_tokens_len;
-    prev_tokens_len = new_n_past;
-    LOGi("cpp: prompt_token_len = %d", prompt_token_len);
-    return prompt_token_len;
-}
-
-int LLM::completion_init(const char* text, bool format_chat, int n_len) {
-    cached_token_chars.clear();
-
-    std::vector<char> formatted(llama_n_ctx(context));
-    const auto model = llama_get_model(context);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
-    const char * tmpl = llama_model_chat_template(model, /* name */ nullptr);
-    messages.push_back({"user", strcpy(new char[strlen(text) + 1], text)});
-    int new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
-    if (new_len > (int)formatted.size()) {
-        formatted.resize(new_len);
-        new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
-    }
-    if (new_len < 0) {
-        LOGe("failed to apply the chat template\n");
+void LLM::cancel_tasks() {
+    const int64_t now = llama_time_us();
+    auto stopped = [now](const Task& task) -> const char* {
+        if (task.options.cancel && *task.options.cancel) {
+            return "cancelled";
+        }
+        if (task.t_deadline > 0 && now >= task.t_deadline) {
+            return "timeout";
+        }
+        return nullptr;
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        for (auto it = queue.begin(); it != queue.end();) {
+            const char* reason = stopped(**it);
+            if (!reason) {
+                ++it;
+                continue;
+            }
+            Result result;
+            result.finish_reason = reason;
+            finish(**it, result);
+            it = queue.erase(it);
+        }
+    }
+    for (auto& slot : slots) {
+        const char* reason = slot.task ? stopped(*slot.task) : nullptr;
+        if (reason) {
+            LOGi("slot %d: %s after %d tokens", slot.id, reason, slot.n_decoded);
+            release_slot(slot, reason);
+        }
     }
-    std::string prompt(formatted.begin() + chat_history_tokens_len, formatted.begin() + new_len);
-    LOGi("Current Chat History (Size: %zu):", messages.size());
-    for (size_t i = 0; i < messages.size(); ++i) {
-        const llama_chat_message& msg_to_log = messages[i];
-        const char* role_to_log = msg_to_log.role ? msg_to_log.role : "[null role]";
-        const char* content_to_log = msg_to_log.content ? msg_to_log.content : "[null content]";
-        LOGi("  Msg %zu: Role: \"%s\", Content: \"%s\"", i, role_to_log, content_to_log);
+}
+
+void LLM::expire_conversations() {
+    // Once a second at most. Conversations idle for conversation_ttl go, those in a slot leave
+    // their KV behind for prefix reuse. Beyond max_conversations the least recently used of those
+    // without a slot go too. A snapshot, if there is one, still brings them back
+    const int64_t now = llama_time_us();
+    if (conversations.empty() || now - t_expired < 1000000) {
+        return;
     }
-    LOGi("prompt:%s",prompt.c_str());
+    t_expired = now;
 
-    bool parse_special = format_chat;
-    const auto tokens_list = common_tokenize(context, prompt, true, parse_special);
+    std::set<std::string> queued;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        for (const auto& task : queue) {
+            queued.insert(task->conversation_id);
+        }
+    }
+
+    const int64_t ttl = (int64_t) (config.conversation_ttl * 1e6);
+    const size_t n_before = conversations.size();
+    std::vector<std::pair<int64_t, std::string>> idle;
+    for (auto it = conversations.begin(); it != conversations.end();) {
+        const Conversation& conv = *it->second;
+        if (conv.busy || queued.count(it->first)) {
+            ++it;
+        } else if (ttl > 0 && now - conv.t_last_used >= ttl) {
+            if (conv.slot_id >= 0) {
+                slots[conv.slot_id].conv.reset();
+            }
+            if (on_conversation_expired) {
+                on_conversation_expired(it->first);
+            }
+            it = conversations.erase(it);
+        } else {
+            if (conv.slot_id < 0) {
+                idle.emplace_back(conv.t_last_used, it->first);
+            }
+            ++it;
+        }
+    }
+    const size_t n_max = config.max_conversations;
+    if (n_max > 0 && conversations.size() > n_max) {
+        std::sort(idle.begin(), idle.end());
+        for (size_t i = 0; i < idle.size() && conversations.size() > n_max; i++) {
+            if (on_conversation_expired) {
+                on_conversation_expired(idle[i].second);
+            }
+            conversations.erase(idle[i].second);
+        }
+    }
+    if (conversations.size() < n_before) {
+        LOGi("expired %zu idle conversations, %zu left", n_before - conversations.size(), conversations.size());
+    }
+}
 
-    auto n_ctx = llama_n_ctx(context);
-    int n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(context), 0);
-    auto n_kv_req = tokens_list.size() + n_len + n_ctx_used;
+bool LLM::has_active_slots() const {
+    for (const auto& slot : slots) {
+        if (slot.state != SLOT_IDLE) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    LOGi("n_len = %d, n_ctx = %d, n_kv_req = %d", n_len, n_ctx, n_kv_req);
+bool LLM::has_idle_slot() const {
+    for (const auto& slot : slots) {
+        if (slot.state == SLOT_IDLE) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (n_kv_req > n_ctx) {
-        LOGe("error: n_kv_req > n_ctx, the required KV cache size is not big enough, clear history kv cache");
-        llama_memory_clear(llama_get_memory(context), true);
-        prev_tokens_len = 0;
+void LLM::assign_tasks() {
+    // A task is taken off the queue under the lock and launched without it: tokenizing, loading a
+    // snapshot and splicing images must not block send_async and cancellations on other threads
+    for (;;) {
+        std::shared_ptr<Task> task;
+        std::shared_ptr<Conversation> conv;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            std::set<std::string> waiting;  // conversations with a turn still waiting for its images
+            for (auto it = queue.begin(); it != queue.end(); ++it) {
+                const Task& queued = **it;
+                const bool images_ready = !queued.media.valid()
+                                          || queued.media.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                if (!images_ready || waiting.count(queued.conversation_id)) {
+                    if (!queued.conversation_id.empty()) {
+                        waiting.insert(queued.conversation_id);
+                    }
+                    continue;
+                }
+
+                std::shared_ptr<Conversation> candidate;
+                if (queued.conversation_id.empty()) {
+                    candidate = std::make_shared<Conversation>();
+                    candidate->chat.set_template(llama_model_chat_template(model, /* name */ nullptr));
+                } else {
+                    auto& entry = conversations[queued.conversation_id];
+                    if (!entry) {
+                        entry = std::make_shared<Conversation>();
+                        entry->id = queued.conversation_id;
+                        entry->t_last_used = llama_time_us();
+                        entry->chat.set_template(llama_model_chat_template(model, /* name */ nullptr));
+                    }
+                    candidate = entry;
+                }
+
+                // Turns of one conversation are processed in order, one at a time. A resident
+                // conversation always finds its own slot idle, any other request needs a free one
+                if (candidate->busy || (candidate->slot_id < 0 && !has_idle_slot())) {
+                    continue;
+                }
+                // One that resumes from its snapshot waits until the IO thread has read it
+                const bool resumes = !candidate->id.empty() && (candidate->slot_id < 0 || slots[candidate->slot_id].lora != queued.lora);
+                if (resumes && snapshots.enabled() && !snapshots.prefetch(candidate->id)) {
+                    continue;
+                }
+
+                task = *it;
+                conv = candidate;
+                queue.erase(it);
+                break;
+            }
+        }
+        if (!task) {
+            return;
+        }
+        launch_slot(task, conv);
     }
+}
 
-    for (auto id : tokens_list) { 
-        LOGi("token: `%s`-> %d ", common_token_to_piece(context, id).c_str(), id); 
+LLM::Slot* LLM::find_slot(const std::vector<llama_token>& tokens, int lora) {
+    // Slots without a conversation go first so resident conversations keep their KV. Among the
+    // candidates the longest cached prefix wins, then the least recently used one
+    bool has_free = false;
+    for (const auto& slot : slots) {
+        if (slot.state == SLOT_IDLE && !slot.conv) {
+            has_free = true;
+        }
     }
-    common_batch_clear(*batch);
-    int pos = prev_tokens_len;
-    LOGi("pos = %d", pos);
 
-    for (auto i = 0; i < tokens_list.size(); i++) {
-        common_batch_add(*batch, tokens_list[i], i+pos, { 0 }, false);
+    Slot* best = nullptr;
+    size_t best_lcp = 0;
+    for (auto& slot : slots) {
+        if (slot.state != SLOT_IDLE || (has_free && slot.conv)) {
+            continue;
+        }
+        // KV computed with another adapter does not match any prompt
+        size_t n_lcp = slot.lora == lora ? common_lcp(slot.cache_tokens, tokens) : 0;
+        if (!best || n_lcp > best_lcp || (n_lcp == best_lcp && slot.t_last_used < best->t_last_used)) {
+            best = &slot;
+            best_lcp = n_lcp;
+        }
     }
+    return best;
+}
 
-    batch->logits[batch->n_tokens - 1] = true;
+size_t LLM::reuse_prefix(Slot& slot, const std::vector<llama_token>& tokens) {
+    auto mem = llama_get_memory(context);
+
+    // At least one token is always decoded again, its logits start the generation. An image is
+    // decoded as a whole, a prefix never ends inside its placeholders
+    const size_t n_max = tokens.size() - 1;
+    auto prefix = [&](const std::vector<llama_token>& cached) {
+        size_t n = std::min(common_lcp(cached, tokens), n_max);
+        while (n > 0 && is_placeholder(tokens[n]) && tokens[n - 1] == tokens[n]) {
+            n--;
+        }
+        return n;
+    };
+    size_t n_reuse = prefix(slot.cache_tokens);
+
+    // A longer prefix may live in another sequence, its cells are shared instead of recomputed
+    Slot* donor = nullptr;
+    size_t n_donor = n_reuse;
+    for (auto& other : slots) {
+        if (&other == &slot || other.lora != slot.lora) {
+            continue;
+        }
+        size_t n_lcp = prefix(other.cache_tokens);
+        if (n_lcp > n_donor) {
+            donor = &other;
+            n_donor = n_lcp;
+        }
+    }
 
-    if (llama_decode(context, *batch) != 0) {
-        LOGe("llama_decode() failed");
+    if (donor) {
+        llama_memory_seq_rm(mem, slot.id, -1, -1);
+        llama_memory_seq_cp(mem, donor->id, slot.id, 0, n_donor);
+        slot.cache_tokens.assign(donor->cache_tokens.begin(), donor->cache_tokens.begin() + n_donor);
+        LOGi("slot %d: sharing %zu cached tokens of slot %d, %zu to prefill", slot.id, n_donor, donor->id, tokens.size() - n_donor);
+        return n_donor;
     }
 
-    prev_tokens_len += batch->n_tokens;
-    return batch->n_tokens;
+    if (!llama_memory_seq_rm(mem, slot.id, n_reuse, -1)) {
+        llama_memory_seq_rm(mem, slot.id, -1, -1);
+        n_reuse = 0;
+    }
+    slot.cache_tokens.resize(n_reuse);
+    LOGi("slot %d: reusing %zu cached tokens, %zu to prefill", slot.id, n_reuse, tokens.size() - n_reuse);
+    return n_reuse;
 }
 
-std::string LLM::completion_loop(int n_len) {
-    const auto model = llama_get_model(context);
-    const auto vocab = llama_model_get_vocab(model);
+bool LLM::restore_snapshot(const std::shared_ptr<Conversation>& conv, int lora) {
+    auto snapshot = snapshots.load(conv->id);
+    if (!snapshot) {
+        return false;
+    }
+    if (snapshot->lora != (lora >= 0 ? adapters[lora].name : "")) {
+        LOGi("conversation %s: snapshot was made with another adapter, prefilling the history", conv->id.c_str());
+        return false;
+    }
+    // The snapshot is written after every turn, a shorter one belongs to a turn that was lost
+    if (!conv->chat.empty() && conv->chat.size() != snapshot->messages.size()) {
+        LOGi("conversation %s: snapshot is stale, prefilling the history", conv->id.c_str());
+        return false;
+    }
+    if (conv->chat.empty()) {
+        for (const auto& msg : snapshot->messages) {
+            conv->chat.push(msg.first, msg.second);
+        }
+    }
 
-    const auto new_token_id = llama_sampler_sample(sampler, context, -1);
+    Slot* slot = find_slot(snapshot->tokens, lora);
+    if (slot->conv) {
+        slot->conv->slot_id = -1;
+        slot->conv->chat_history_len = 0;
+        slot->conv.reset();
+    }
 
-    if (llama_vocab_is_eog(vocab, new_token_id) ) {
-        LOGi("DONE Loop retrun nullptr, n_len:%d" ,n_len);
-        return "";
+    // The tokens may still be in the slot, otherwise the state is loaded into its sequence
+    auto mem = llama_get_memory(context);
+    size_t n_tokens = snapshot->tokens.size();
+    if (slot->lora == lora && common_lcp(slot->cache_tokens, snapshot->tokens) == n_tokens) {
+        llama_memory_seq_rm(mem, slot->id, n_tokens, -1);
+        slot->cache_tokens.resize(n_tokens);
+    } else {
+        llama_memory_seq_rm(mem, slot->id, -1, -1);
+        slot->cache_tokens.clear();
+        if (llama_state_seq_set_data(context, snapshot->state.data(), snapshot->state.size(), slot->id) == 0) {
+            LOGe("conversation %s: failed to load the snapshot state", conv->id.c_str());
+            llama_memory_seq_rm(mem, slot->id, -1, -1);
+            return false;
+        }
+        slot->cache_tokens = snapshot->tokens;
+        slot->lora = lora;
     }
 
-    auto new_token_chars = common_token_to_piece(context, new_token_id);
-    cached_token_chars += new_token_chars;
+    slot->conv = conv;
+    conv->slot_id = slot->id;
+    conv->chat_history_len = snapshot->chat_history_len;
+    conv->message_pos.assign(snapshot->message_pos.begin(), snapshot->message_pos.end());
+    LOGi("conversation %s: resumed %zu tokens from snapshot into slot %d", conv->id.c_str(), n_tokens, slot->id);
+    return true;
+}
 
-    if (is_valid_utf8(cached_token_chars.c_str())) {
-        LOGi("cached: %s, new_token_chars: `%s`, id: %d", cached_token_chars.c_str(), new_token_chars.c_str(), new_token_id);
-        std::string result = cached_token_chars;
-        cached_token_chars.clear();
-        
-        common_batch_clear(*batch);
-        common_batch_add(*batch, new_token_id, prev_tokens_len, {0 }, true);
+void LLM::save_snapshot(const Slot& slot) {
+    const Conversation& conv = *slot.conv;
+    if (slot.cache_tokens.empty()) {
+        return;
+    }
+
+    auto snapshot = std::make_shared<KVSnapshotStore::Snapshot>();
+    snapshot->conversation_id = conv.id;
+    snapshot->lora = slot.lora >= 0 ? adapters[slot.lora].name : "";
+    for (size_t i = 0; i < conv.chat.size(); i++) {
+        snapshot->messages.emplace_back(conv.chat[i].role, conv.chat[i].content);
+    }
+    snapshot->chat_history_len = conv.chat_history_len;
+    snapshot->message_pos.assign(conv.message_pos.begin(), conv.message_pos.end());
+    snapshot->tokens = slot.cache_tokens;
+
+    // Copying the state out is the only part done on the scheduler thread
+    snapshot->state.resize(llama_state_seq_get_size(context, slot.id));
+    snapshot->state.resize(llama_state_seq_get_data(context, snapshot->state.data(), snapshot->state.size(), slot.id));
+    snapshots.save(std::move(snapshot));
+}
+
+bool LLM::launch_slot(const std::shared_ptr<Task>& task, const std::shared_ptr<Conversation>& conv) {
+    conv->busy = true;
+    conv->t_last_used = llama_time_us();
 
-        prev_tokens_len++;
+    // The history in the KV cache was computed with another adapter, it is prefilled again
+    if (conv->slot_id >= 0 && slots[conv->slot_id].lora != task->lora) {
+        evict_slot(slots[conv->slot_id]);
+    }
+    if (!conv->id.empty() && conv->slot_id < 0 && snapshots.enabled()) {
+        restore_snapshot(conv, task->lora);
+    }
 
-        if (llama_decode(context, *batch) != 0) {
-            LOGe("llama_decode() returned null");
+    // Only the new turn is rendered, the history before chat_history_len is already in the KV cache
+    std::string prompt;
+    int think_state = 0;
+    {
+        trace::Scope<trace::LEVEL_REQUEST> span(trace::TEMPLATE_RENDER, conv->slot_id);
+        if (!conv->chat.push("user", task->user_input)) {
+            LOGe("failed to apply the chat template\n");
+            conv->busy = false;
+            finish(*task, error_result("failed to apply the chat template", false));
+            return false;
+        }
+        const std::string generation_prompt = conv->chat.generation_prompt();
+        prompt = conv->chat.text().substr(conv->chat_history_len) + generation_prompt;
+
+        // Some templates open the think block in the generation prompt. Without reasoning, or
+        // with a grammar the think block could not satisfy, the block is prefilled empty
+        if (think_end != LLAMA_TOKEN_NULL) {
+            const size_t open = generation_prompt.rfind("<think>");
+            if (open != std::string::npos && generation_prompt.find("</think>", open) == std::string::npos) {
+                think_state = 1;
+            }
+            if (!task->options.reasoning || !task->options.grammar.empty()) {
+                prompt += think_state == 1 ? "\n</think>\n\n" : "<think>\n\n</think>\n\n";
+                think_state = 2;
+            }
         }
+        span.a = prompt.size();
+        span.b = conv->chat.size();
+    }
 
-        return result;
+    // A resident conversation continues its own sequence. Anything else is rendered in full and
+    // placed where the longest prefix of it is already cached
+    const bool resident = conv->slot_id >= 0;
+    Slot* slot = nullptr;
+    std::vector<llama_token> tokens_list;
+    if (conv->slot_id >= 0) {
+        slot = &slots[conv->slot_id];
+        tokens_list = slot->cache_tokens;
+        trace::Scope<trace::LEVEL_REQUEST> span(trace::TOKENIZE, slot->id);
+        auto new_tokens = tokenize_turns(*conv, prompt, conv->chat.size() - 1, tokens_list.size(), slot->cache_tokens.empty());
+        tokens_list.insert(tokens_list.end(), new_tokens.begin(), new_tokens.end());
+        span.a = new_tokens.size();
+        span.b = prompt.size();
     } else {
-        return "";
+        trace::Scope<trace::LEVEL_REQUEST> span(trace::TOKENIZE, -1);
+        tokens_list = tokenize_turns(*conv, prompt, 0, 0, true);
+        span.a = tokens_list.size();
+        span.b = prompt.size();
+        slot = find_slot(tokens_list, task->lora);
+        if (slot->conv) {
+            slot->conv->slot_id = -1;
+            slot->conv->chat_history_len = 0;
+        }
+        slot->conv = conv;
+        conv->slot_id = slot->id;
     }
+
+    // A turn that cannot start leaves a slot it was just placed on, the KV there belongs to
+    // whatever ran in the slot before and must not become the conversation's history
+    auto fail = [&](const std::string& error) {
+        fail_slot(*slot, error, true);
+        if (!resident) {
+            conv->slot_id = -1;
+            conv->chat_history_len = 0;
+            slot->conv.reset();
+        }
+        return false;
+    };
+
+    slot->task = task;
+    slot->error.clear();
+    slot->bad_request = false;
+    slot->cached_token_chars.clear();
+    slot->utf8.reset();
+    slot->generated.clear();
+    slot->reasoning.clear();
+    // Room for the whole answer at a few bytes per token, the buffers keep their capacity across
+    // requests so a slot rarely grows them while decoding
+    slot->generated.reserve(std::min(task->n_len, n_ctx_slot) * 4);
+    if (think_state != 2 && think_end != LLAMA_TOKEN_NULL) {
+        slot->reasoning.reserve(std::min(task->n_len, n_ctx_slot) * 4);
+    }
+    slot->think_state = think_state;
+    slot->n_thinking = 0;
+    slot->n_sent = 0;
+    slot->n_decoded = 0;
+    slot->n_drafted = 0;
+    slot->n_draft_accepted = 0;
+    slot->i_batch = -1;
+    slot->t_last_used = llama_time_us();
+
+    // A chain with a grammar is built for the request, plain ones come from the pool. Greedy
+    // sampling without a grammar needs no chain at all
+    const SamplerParams params = sampler_params(task->options);
+    if (!task->options.grammar.empty()) {
+        llama_sampler* grammar = grammar_sampler(task->options.grammar);
+        if (!grammar) {
+            return fail("the grammar of the request is invalid");
+        }
+        slot->sampler = LLM::new_sampler(params, grammar);
+    } else if (params.temp > 0.0f) {
+        slot->sampler = acquire_sampler(params);
+        slot->sampler_params = params;
+        slot->sampler_pooled = true;
+    }
+
+    // Images go in front of the user's text. Shifting the context moves the message, and them with it
+    const size_t media_at = conv->message_pos.back();
+    std::vector<Media> media;
+    if (task->media.valid()) {
+        auto prepared = task->media.get();
+        if (!prepared->ok) {
+            return fail("cannot read an image of the request");
+        }
+        tokens_list.insert(tokens_list.begin() + media_at, prepared->tokens.begin(), prepared->tokens.end());
+        media = std::move(prepared->media);
+        for (auto& item : media) {
+            item.pos += media_at;
+        }
+    }
+
+    // Shifting makes room for a quarter of the context at most, a longer answer stops at "length"
+    // rather than dropping more of the history
+    const int n_reserve = std::min(task->n_len, n_ctx_slot / 4);
+    if (context_shift && (int) tokens_list.size() + n_reserve > n_ctx_slot) {
+        shift_context(*slot, *conv, tokens_list, n_reserve);
+    }
+
+    if (tokens_list.empty()) {
+        return fail("the prompt is empty");
+    }
+    // Whatever the prompt leaves of the context is what can be generated
+    if ((int) tokens_list.size() >= n_ctx_slot) {
+        return fail("a prompt of " + std::to_string(tokens_list.size()) + " tokens does not fit the context of " +
+                    std::to_string(n_ctx_slot) + " tokens");
+    }
+    slot->n_len = std::min(task->n_len, n_ctx_slot - (int) tokens_list.size());
+
+    if (slot->lora != task->lora) {
+        llama_memory_seq_rm(llama_get_memory(context), slot->id, -1, -1);
+        slot->cache_tokens.clear();
+        slot->lora = task->lora;
+    }
+    size_t n_reuse = reuse_prefix(*slot, tokens_list);
+    slot->n_prompt = tokens_list.size();
+    slot->n_cached = n_reuse;
+    slot->prompt_tokens.assign(tokens_list.begin() + n_reuse, tokens_list.end());
+    slot->n_prompt_done = 0;
+    slot->n_past = n_reuse;
+    slot->state = SLOT_PREFILL;
+
+    // Images already in the reused prefix are done, the others start encoding now and are decoded
+    // when the prefill gets to them
+    for (auto& item : media) {
+        item.pos = item.pos - media_at + conv->message_pos.back();
+        if (item.pos < n_reuse) {
+            continue;
+        }
+        item.pos -= n_reuse;
+        encode_media(item);
+        slot->media.push_back(std::move(item));
+    }
+    return true;
 }
 
-void LLM::kv_cache_clear() {
-    llama_memory_clear(llama_get_memory(context), true);
-    prev_tokens_len=0;
-    chat_history_tokens_len = 0;
-    messages.clear();
+std::vector<llama_token> LLM::tokenize_turns(Conversation& conv, const std::string& text, size_t first, size_t base, bool add_special) {
+    // text is the rendering of conv.chat[first..]. It is cut in front of each message's content
+    // so the positions of the turns are known when they have to be dropped from the KV cache
+    std::vector<llama_token> tokens;
+    size_t cursor = 0;
+    conv.message_pos.resize(first);
+    for (size_t i = first; i < conv.chat.size(); i++) {
+        size_t found = text.find(conv.chat[i].content, cursor);
+        if (found != std::string::npos && found > cursor) {
+            auto part = common_tokenize(context, text.substr(cursor, found - cursor), add_special && cursor == 0, true);
+            tokens.insert(tokens.end(), part.begin(), part.end());
+            cursor = found;
+        }
+        conv.message_pos.push_back(base + tokens.size());
+    }
+    auto rest = common_tokenize(context, text.substr(cursor), add_special && cursor == 0, true);
+    tokens.insert(tokens.end(), rest.begin(), rest.end());
+    return tokens;
 }
 
-void LLM::supply(const char* text) {
-    messages.push_back({"assistant", strcpy(new char[strlen(text) + 1], text)});
-    const char * tmpl = llama_model_chat_template(model, /* name */ nullptr);
-    chat_history_tokens_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), false, nullptr, 0);
-    if (chat_history_tokens_len < 0) {
-        LOGe("failed to apply the chat template\n");
+bool LLM::shift_context(Slot& slot, Conversation& conv, std::vector<llama_token>& tokens, int n_len) {
+    if (conv.message_pos.size() != conv.chat.size()) {
+        return false;
+    }
+
+    // Leading system/tool messages are pinned. Whole turns are dropped after them, from the content
+    // of the first droppable message to the content of a later message of the same role, so the
+    // role header in front of the cut still matches what follows it
+    size_t first = 0;
+    while (first < conv.chat.size() && (strcmp(conv.chat[first].role, "system") == 0 || strcmp(conv.chat[first].role, "tool") == 0)) {
+        first++;
     }
+    if (first + 1 >= conv.chat.size()) {
+        return false;
+    }
+    const int n_needed = tokens.size() + n_len - n_ctx_slot;
+    size_t last = first + 1;
+    while (last < conv.chat.size() && (strcmp(conv.chat[last].role, conv.chat[first].role) != 0
+                                           || conv.message_pos[last] - conv.message_pos[first] < n_needed)) {
+        last++;
+    }
+    if (last == conv.chat.size()) {
+        LOGe("slot %d: dropping all turns still leaves no room for %d tokens", slot.id, n_len);
+        return false;
+    }
+
+    const llama_pos p0 = conv.message_pos[first];
+    const llama_pos p1 = conv.message_pos[last];
+    const int n_discard = p1 - p0;
+
+    // Cells already cached are moved instead of decoded again, in the draft context as well
+    auto shift = [&](llama_context* ctx, std::vector<llama_token>& cached) {
+        auto mem = llama_get_memory(ctx);
+        if ((llama_pos) common_lcp(cached, tokens) < p1 || !llama_memory_can_shift(mem)) {
+            return;
+        }
+        llama_memory_seq_rm(mem, slot.id, p0, p1);
+        llama_memory_seq_add(mem, slot.id, p1, -1, -n_discard);
+        cached.erase(cached.begin() + p0, cached.begin() + p1);
+    };
+    shift(context, slot.cache_tokens);
+    if (draft_context) {
+        shift(draft_context, slot.draft_cache);
+    }
+    tokens.erase(tokens.begin() + p0, tokens.begin() + p1);
+
+    conv.chat.erase(first, last);
+    conv.message_pos.erase(conv.message_pos.begin() + first, conv.message_pos.begin() + last);
+    for (size_t i = first; i < conv.message_pos.size(); i++) {
+        conv.message_pos[i] -= n_discard;
+    }
+    if (conv.chat_history_len > 0) {
+        conv.chat_history_len = conv.chat.text_length(conv.chat.size() - 1);
+    }
+
+    trace::instant<trace::LEVEL_REQUEST>(trace::CONTEXT_SHIFT, slot.id, n_discard, p0);
+    LOGi("slot %d: context shift dropped %zu messages (%d tokens) after %d pinned tokens", slot.id, last - first, n_discard, p0);
+    return true;
 }
 
-bool LLM::is_valid_utf8(const char * string) {
-    if (!string) {
+static bool parse_cpus(const std::string& spec, bool (&mask)[GGML_MAX_N_THREADS]) {
+    if (spec.empty()) {
         return true;
     }
+    return spec.find('-') != std::string::npos ? parse_cpu_range(spec, mask) : parse_cpu_mask(spec, mask);
+}
+
+bool LLM::new_threadpools() {
+    ggml_threadpool_params params = ggml_threadpool_params_default(config.threads());
+    ggml_threadpool_params params_batch = ggml_threadpool_params_default(config.threads_batch());
+    if (!parse_cpus(config.cpu_mask, params.cpumask) || !parse_cpus(config.cpu_mask_batch, params_batch.cpumask)) {
+        LOGe("new_threadpools(): invalid cpu mask %s / %s", config.cpu_mask.c_str(), config.cpu_mask_batch.c_str());
+        return false;
+    }
+    params.strict_cpu = params_batch.strict_cpu = config.cpu_strict;
+    params.poll = params_batch.poll = config.poll;
+    // Nothing runs until the first request arrives
+    params.paused = params_batch.paused = true;
+
+    threadpool = ggml_threadpool_new(&params);
+    threadpool_batch = ggml_threadpool_new(&params_batch);
+    if (!threadpool || !threadpool_batch) {
+        LOGe("new_threadpools(): ggml_threadpool_new() failed");
+        if (threadpool) {
+            ggml_threadpool_free(threadpool);
+            threadpool = nullptr;
+        }
+        if (threadpool_batch) {
+            ggml_threadpool_free(threadpool_batch);
+            threadpool_batch = nullptr;
+        }
+        return false;
+    }
+    threadpools_paused = true;
+
+    // The draft model only decodes a few tokens per sequence, it always runs on the decode pool
+    if (draft_context) {
+        llama_attach_threadpool(draft_context, threadpool, threadpool);
+        llama_set_n_threads(draft_context, config.threads(), config.threads());
+    }
+    use_threadpool(true);
+    LOGi("threadpools: decode %d threads (%s), prefill %d threads (%s), poll %d", config.threads(),
+         config.cpu_mask.empty() ? "any cpu" : config.cpu_mask.c_str(), config.threads_batch(),
+         config.cpu_mask_batch.empty() ? "any cpu" : config.cpu_mask_batch.c_str(), config.poll);
+    return true;
+}
 
-    const unsigned char * bytes = (const unsigned char *)string;
-    int num;
+void LLM::use_threadpool(bool prefill) {
+    // llama.cpp would pick by the number of tokens in a ubatch, but a decode step of several
+    // slots is still latency bound, so the pool follows whether the step carries prompt tokens
+    if (!threadpool || threadpool_mode == (int) prefill) {
+        return;
+    }
+    ggml_threadpool* pool = prefill ? threadpool_batch : threadpool;
+    const int n_threads = prefill ? config.threads_batch() : config.threads();
+    llama_attach_threadpool(context, pool, pool);
+    llama_set_n_threads(context, n_threads, n_threads);
+    threadpool_mode = prefill;
+}
 
-    while (*bytes != 0x00) {
-        if ((*bytes & 0x80) == 0x00) {
-            num = 1;
-        } else if ((*bytes & 0xE0) == 0xC0) {
-            num = 2;
-        } else if ((*bytes & 0xF0) == 0xE0) {
-            num = 3;
-        } else if ((*bytes & 0xF8) == 0xF0) {
-            num = 4;
-        } else {
-            return false;
+void LLM::pause_threadpools(bool pause) {
+    if (!threadpool || threadpools_paused == pause) {
+        return;
+    }
+    if (pause) {
+        ggml_threadpool_pause(threadpool);
+        ggml_threadpool_pause(threadpool_batch);
+    } else {
+        ggml_threadpool_resume(threadpool);
+        ggml_threadpool_resume(threadpool_batch);
+    }
+    threadpools_paused = pause;
+}
+
+bool LLM::load_draft() {
+    const std::string& draft_model_path = config.draft_model_path;
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = config.gpu_layers;
+
+    draft_model = llama_model_load_from_file(draft_model_path.c_str(), model_params);
+    if (!draft_model) {
+        LOGe("load_draft(): cannot load %s", draft_model_path.c_str());
+        return false;
+    }
+
+    // Drafted token ids are fed to the target as they are, both models need the same vocabulary
+    const llama_vocab * vocab_tgt = llama_model_get_vocab(model);
+    const llama_vocab * vocab_dft = llama_model_get_vocab(draft_model);
+    bool compatible = llama_vocab_type(vocab_tgt) == llama_vocab_type(vocab_dft)
+                   && llama_vocab_bos(vocab_tgt) == llama_vocab_bos(vocab_dft)
+                   && llama_vocab_eos(vocab_tgt) == llama_vocab_eos(vocab_dft)
+                   && std::abs(llama_vocab_n_tokens(vocab_tgt) - llama_vocab_n_tokens(vocab_dft)) <= 128;
+    const int n_vocab = std::min(llama_vocab_n_tokens(vocab_tgt), llama_vocab_n_tokens(vocab_dft));
+    for (int i = 5; compatible && i < n_vocab; i++) {
+        compatible = strcmp(llama_vocab_get_text(vocab_tgt, i), llama_vocab_get_text(vocab_dft, i)) == 0;
+    }
+    if (!compatible) {
+        LOGe("load_draft(): the vocabulary of %s does not match the target model", draft_model_path.c_str());
+        LLM::free_model(draft_model);
+        draft_model = nullptr;
+        return false;
+    }
+
+    // Same layout as the target context, sequence i of both belongs to slot i
+    draft_context = LLM::new_context(draft_model, config);
+    if (!draft_context) {
+        LLM::free_model(draft_model);
+        draft_model = nullptr;
+        return false;
+    }
+    draft_batch = LLM::new_batch(n_batch, 0, 1);
+
+    LOGi("speculative decoding: draft model %s, n_max = %d, p_min = %.2f", draft_model_path.c_str(), spec_params.n_max, spec_params.p_min);
+    return true;
+}
+
+void LLM::draft_tokens() {
+    for (auto& slot : slots) {
+        slot.draft.clear();
+        slot.i_draft = -1;
+    }
+    if (!draft_context) {
+        return;
+    }
+    trace::Scope<trace::LEVEL_STEP> span(trace::DRAFT, -1);
+
+    int n_decoding = 0;
+    for (const auto& slot : slots) {
+        n_decoding += slot.state == SLOT_DECODE && slot.lora == active_lora;
+    }
+    common_batch_clear(*draft_batch);
+
+    // Bring every generating sequence of the draft context up to the target: drop what differs
+    // from cache_tokens, then evaluate the rest plus the token about to be decoded
+    for (auto& slot : slots) {
+        // The draft model has no vision encoder, sequences with images are not drafted. Neither
+        // are those thinking on a budget, which is checked token by token
+        if (slot.state != SLOT_DECODE || slot.lora != active_lora
+            || (slot.think_state != 2 && slot.task->options.max_thinking_tokens >= 0)
+            || std::any_of(slot.cache_tokens.begin(), slot.cache_tokens.end(), is_placeholder)) {
+            continue;
+        }
+        size_t n_keep = common_lcp(slot.draft_cache, slot.cache_tokens);
+        if (n_keep < slot.draft_cache.size()) {
+            llama_memory_seq_rm(llama_get_memory(draft_context), slot.id, n_keep, -1);
+            slot.draft_cache.resize(n_keep);
         }
 
-        bytes += 1;
-        for (int i = 1; i < num; ++i) {
-            if ((*bytes & 0xC0) != 0x80) {
-                return false;
+        std::vector<llama_token> pending(slot.cache_tokens.begin() + n_keep, slot.cache_tokens.end());
+        pending.push_back(slot.sampled);
+        int n_room = n_batch - draft_batch->n_tokens;
+        int n_add = std::min(n_room, (int) pending.size());
+        for (int i = 0; i < n_add; i++) {
+            common_batch_add(*draft_batch, pending[i], slot.draft_cache.size(), { slot.id }, false);
+            slot.draft_cache.push_back(pending[i]);
+        }
+        // A long prompt is caught up over several steps, drafting starts once it is complete
+        if (n_add == (int) pending.size()) {
+            draft_batch->logits[draft_batch->n_tokens - 1] = true;
+            slot.i_draft = draft_batch->n_tokens - 1;
+        }
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(draft_model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    while (draft_batch->n_tokens > 0) {
+        if (llama_decode(draft_context, *draft_batch) != 0) {
+            LOGe("draft llama_decode() failed, n_tokens = %d", draft_batch->n_tokens);
+            for (auto& slot : slots) {
+                llama_memory_seq_rm(llama_get_memory(draft_context), slot.id, -1, -1);
+                slot.draft_cache.clear();
+                slot.draft.clear();
+                slot.i_draft = -1;
             }
-            bytes += 1;
+            return;
+        }
+        common_batch_clear(*draft_batch);
+
+        // Greedy drafting, a sequence stops as soon as the draft model is unsure of its next token
+        for (auto& slot : slots) {
+            if (slot.i_draft < 0) {
+                continue;
+            }
+            const float * logits = llama_get_logits_ith(draft_context, slot.i_draft);
+            slot.i_draft = -1;
+
+            const llama_token best = argmax(logits, n_vocab);
+            double sum = 0.0;
+            for (llama_token id = 0; id < n_vocab; id++) {
+                sum += exp(logits[id] - logits[best]);
+            }
+            // Every draft token costs a batch entry and a KV cell of the target, and is useless past n_len
+            const int n_max = std::min({
+                spec_params.n_max,
+                n_batch / n_decoding - 1,
+                n_ctx_slot - slot.n_past - 2,
+                slot.n_len - slot.n_decoded - 1,
+            });
+            if (1.0 / sum < spec_params.p_min || (int) slot.draft.size() >= n_max) {
+                continue;
+            }
+            slot.draft.push_back(best);
+            if ((int) slot.draft.size() >= n_max || llama_vocab_is_eog(vocab, best)) {
+                continue;
+            }
+            slot.i_draft = draft_batch->n_tokens;
+            common_batch_add(*draft_batch, best, slot.draft_cache.size(), { slot.id }, true);
+            slot.draft_cache.push_back(best);
+        }
+    }
+
+    for (auto& slot : slots) {
+        if ((int) slot.draft.size() < spec_params.n_min) {
+            slot.draft.clear();
+        }
+        span.a += slot.draft.size();
+    }
+    span.b = n_decoding;
+}
+
+void LLM::verify_draft(Slot& slot) {
+    // The target samples at every drafted position, a draft token is kept while it matches what
+    // was sampled. The first mismatch is the target's own token, so at least one token comes out
+    trace::Scope<trace::LEVEL_TOKEN> span(trace::VERIFY, slot.id);
+    size_t n_accepted = 0;
+    llama_token id = sample(slot, slot.i_batch);
+    while (n_accepted < slot.draft.size() && id == slot.draft[n_accepted]) {
+        n_accepted++;
+        id = sample(slot, slot.i_batch + n_accepted);
+    }
+    slot.i_batch = -1;
+    span.a = slot.draft.size();
+    span.b = n_accepted;
+    slot.n_drafted += slot.draft.size();
+    slot.n_draft_accepted += n_accepted;
+
+    // Drop the rejected tokens, the accepted ones go back into cache_tokens as they are processed
+    const llama_pos n_past = slot.n_past - slot.draft.size();
+    llama_memory_seq_rm(llama_get_memory(context), slot.id, n_past + n_accepted, -1);
+    slot.cache_tokens.resize(n_past);
+    slot.n_past = n_past;
+
+    std::vector<llama_token> accepted(slot.draft.begin(), slot.draft.begin() + n_accepted);
+    slot.draft.clear();
+    for (llama_token token : accepted) {
+        process_token(slot, token);
+        if (slot.state != SLOT_DECODE) {
+            llama_memory_seq_rm(llama_get_memory(context), slot.id, slot.n_past, -1);
+            return;
+        }
+        slot.cache_tokens.push_back(token);
+        slot.n_past++;
+    }
+    process_token(slot, id);
+}
+
+bool LLM::update_slots() {
+    // Only the slots of the active adapter take part in this step
+    select_lora();
+
+    // Images whose embedding is ready are decoded on their own, they cannot share a batch
+    bool progress = false;
+    for (auto& slot : slots) {
+        if (slot.lora == active_lora) {
+            progress |= decode_media(slot);
+        }
+    }
+
+    draft_tokens();
+    common_batch_clear(*batch);
+
+    // One token for every sequence that is generating, followed by its draft if there is one.
+    // The batch holds n_batch tokens, a slot that does not fit waits for the next step and a
+    // draft is cut to the room left
+    for (auto& slot : slots) {
+        if (slot.state != SLOT_DECODE || slot.lora != active_lora) {
+            continue;
+        }
+        if (batch->n_tokens >= n_batch) {
+            slot.draft.clear();
+            continue;
+        }
+        slot.i_batch = batch->n_tokens;
+        common_batch_add(*batch, slot.sampled, slot.n_past, { slot.id }, true);
+        slot.cache_tokens.push_back(slot.sampled);
+        slot.n_past++;
+        if ((int) slot.draft.size() > n_batch - batch->n_tokens) {
+            slot.draft.resize(n_batch - batch->n_tokens);
+        }
+        for (llama_token id : slot.draft) {
+            common_batch_add(*batch, id, slot.n_past, { slot.id }, true);
+            slot.cache_tokens.push_back(id);
+            slot.n_past++;
         }
     }
 
+    // Prompts are prefilled in chunks with whatever room is left, so a long prompt takes several
+    // steps and the sequences above keep getting one token per step while it is ingested
+    bool has_prefill = false;
+    for (auto& slot : slots) {
+        if (slot.state != SLOT_PREFILL || slot.lora != active_lora || batch->n_tokens >= n_batch) {
+            continue;
+        }
+        // The prefill stops in front of the next image until it has been decoded
+        const size_t n_end = slot.media.empty() ? slot.prompt_tokens.size() : slot.media.front().pos;
+        int n_chunk = std::min(n_batch - batch->n_tokens, (int) (n_end - slot.n_prompt_done));
+        if (n_chunk == 0) {
+            continue;
+        }
+        has_prefill = true;
+        for (int i = 0; i < n_chunk; i++) {
+            llama_token id = slot.prompt_tokens[slot.n_prompt_done++];
+            common_batch_add(*batch, id, slot.n_past, { slot.id }, false);
+            slot.cache_tokens.push_back(id);
+            slot.n_past++;
+        }
+        trace::instant<trace::LEVEL_STEP>(trace::PREFILL_CHUNK, slot.id, n_chunk, slot.n_prompt_done);
+        if (slot.n_prompt_done < slot.prompt_tokens.size()) {
+            continue;
+        }
+        batch->logits[batch->n_tokens - 1] = true;
+        slot.i_batch = batch->n_tokens - 1;
+        slot.prompt_tokens.clear();
+        slot.state = SLOT_DECODE;
+    }
+
+    if (batch->n_tokens == 0) {
+        return progress;
+    }
+
+    int ret;
+    {
+        trace::Scope<trace::LEVEL_STEP> span(trace::DECODE_STEP, -1);
+        span.a = batch->n_tokens;
+        for (const auto& slot : slots) {
+            span.b += slot.state == SLOT_DECODE;
+        }
+        use_threadpool(has_prefill);
+        ret = llama_decode(context, *batch);
+    }
+    if (ret != 0) {
+        LOGe("llama_decode() failed, n_tokens = %d", batch->n_tokens);
+        for (auto& slot : slots) {
+            if (slot.i_batch >= 0) {
+                // The KV of a failed batch is not trustworthy, nothing of it may end up in a snapshot
+                slot.i_batch = -1;
+                slot.draft.clear();
+                llama_memory_seq_rm(llama_get_memory(context), slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                fail_slot(slot, "llama_decode() failed", false);
+                evict_slot(slot);
+            }
+        }
+        return true;
+    }
+
+    for (auto& slot : slots) {
+        if (slot.i_batch < 0) {
+            continue;
+        }
+        if (!slot.draft.empty()) {
+            verify_draft(slot);
+            continue;
+        }
+        llama_token new_token_id;
+        {
+            trace::Scope<trace::LEVEL_TOKEN> span(trace::SAMPLE, slot.id);
+            new_token_id = sample(slot, slot.i_batch);
+            span.a = new_token_id;
+        }
+        slot.i_batch = -1;
+        process_token(slot, new_token_id);
+    }
     return true;
 }
 
+llama_sampler* LLM::grammar_sampler(const std::string& gbnf) {
+    auto it = grammar_cache.find(gbnf);
+    if (it == grammar_cache.end()) {
+        llama_sampler* grammar = llama_sampler_init_grammar(llama_model_get_vocab(model), gbnf.c_str(), "root");
+        if (!grammar) {
+            return nullptr;
+        }
+        if (grammar_cache.size() >= 64) {
+            LLM::free_sampler(grammar_cache.begin()->second);
+            grammar_cache.erase(grammar_cache.begin());
+        }
+        it = grammar_cache.emplace(gbnf, grammar).first;
+    }
+    return llama_sampler_clone(it->second);
+}
+
+llama_sampler* LLM::acquire_sampler(const SamplerParams& params) {
+    auto it = sampler_pool.find(params);
+    if (it == sampler_pool.end() || it->second.empty()) {
+        return LLM::new_sampler(params);
+    }
+    // Reset restores the seed of a seeded chain, a random one draws a new seed
+    llama_sampler* sampler = it->second.back();
+    it->second.pop_back();
+    llama_sampler_reset(sampler);
+    return sampler;
+}
+
+void LLM::release_sampler(Slot& slot) {
+    if (!slot.sampler) {
+        return;
+    }
+    if (!slot.sampler_pooled) {
+        LLM::free_sampler(slot.sampler);
+    } else {
+        // Every distinct seed is a key of its own, the pool keeps a bounded number of them
+        auto it = sampler_pool.find(slot.sampler_params);
+        if (it == sampler_pool.end() && sampler_pool.size() >= 64) {
+            for (llama_sampler* sampler : sampler_pool.begin()->second) {
+                LLM::free_sampler(sampler);
+            }
+            sampler_pool.erase(sampler_pool.begin());
+        }
+        auto& idle = sampler_pool[slot.sampler_params];
+        if (idle.size() < slots.size()) {
+            idle.push_back(slot.sampler);
+        } else {
+            LLM::free_sampler(slot.sampler);
+        }
+    }
+    slot.sampler = nullptr;
+    slot.sampler_pooled = false;
+}
+
+llama_token LLM::sample(Slot& slot, int idx) {
+    if (slot.sampler) {
+        return llama_sampler_sample(slot.sampler, context, idx);
+    }
+    // Greedy: the token is the argmax of the logits, no candidate array is built or sorted
+    return argmax(llama_get_logits_ith(context, idx), llama_vocab_n_tokens(llama_model_get_vocab(model)));
+}
+
+void LLM::process_token(Slot& slot, llama_token new_token_id) {
+    const auto vocab = llama_model_get_vocab(model);
+
+    if (llama_vocab_is_eog(vocab, new_token_id)) {
+        LOGi("slot %d: DONE, n_decoded = %d", slot.id, slot.n_decoded);
+        release_slot(slot);
+        return;
+    }
+
+    // The think block is tracked by its tokens. Once the budget is spent, </think> replaces
+    // whatever was sampled. The delimiters themselves are not output
+    bool delimiter = false;
+    if (think_end != LLAMA_TOKEN_NULL) {
+        const int budget = slot.task->options.max_thinking_tokens;
+        if (slot.think_state == 1 && budget >= 0 && slot.n_thinking >= budget && new_token_id != think_end) {
+            LOGi("slot %d: thinking budget of %d tokens spent, closing the think block", slot.id, budget);
+            new_token_id = think_end;
+        }
+        if (new_token_id == think_start && slot.think_state == 0) {
+            slot.think_state = 1;
+            delimiter = true;
+        } else if (new_token_id == think_end && slot.think_state == 1) {
+            slot.think_state = 2;
+            delimiter = true;
+        } else if (slot.think_state == 1) {
+            slot.n_thinking++;
+        }
+    }
+
+    // Text ready for output: the new piece, with the bytes of a character it completes in front
+    bool ready = false;
+    std::string_view text;
+    if (!delimiter) {
+        trace::Scope<trace::LEVEL_TOKEN> span(trace::DETOKENIZE, slot.id);
+        const std::string_view piece = pieces.get(new_token_id);
+        ready = slot.utf8.feed(piece);
+        if (ready && slot.cached_token_chars.empty()) {
+            text = piece;
+        } else {
+            slot.cached_token_chars.append(piece.data(), piece.size());
+            text = slot.cached_token_chars;
+        }
+        span.a = new_token_id;
+        span.b = piece.size();
+    }
+
+    if (slot.think_state == 1 && ready) {
+        slot.reasoning.append(text.data(), text.size());
+        bool keep_going = !slot.task->options.on_reasoning || slot.task->options.on_reasoning(text);
+        slot.cached_token_chars.clear();
+        if (!keep_going) {
+            LOGi("slot %d: stopped by the token consumer, n_decoded = %d", slot.id, slot.n_decoded);
+            release_slot(slot, "cancelled");
+            return;
+        }
+    } else if (ready) {
+        // The blank lines after </think> belong to the template, not the answer
+        if (slot.generated.empty() && slot.think_state == 2) {
+            text.remove_prefix(std::min(text.find_first_not_of(" \n"), text.size()));
+        }
+        slot.generated.append(text.data(), text.size());
+        slot.cached_token_chars.clear();
+
+        // A stop string ends the generation, neither it nor anything after it is output. Text that
+        // could be the start of one is held back until it is known not to be
+        const std::string_view unsent = std::string_view(slot.generated).substr(slot.n_sent);
+        size_t n_stop = std::string::npos;
+        size_t n_partial = std::string::npos;
+        for (const auto& stop : slot.task->options.stop) {
+            n_stop = std::min(n_stop, unsent.find(stop));
+            n_partial = std::min(n_partial, string_find_partial_stop(unsent, stop));
+        }
+        const bool stopped = n_stop != std::string::npos;
+        if (stopped) {
+            slot.generated.resize(slot.n_sent + n_stop);
+        }
+        const size_t n_ready = stopped || n_partial == std::string::npos ? slot.generated.size() : slot.n_sent + n_partial;
+
+        bool keep_going = true;
+        if (n_ready > slot.n_sent) {
+            keep_going = !slot.task->on_token || slot.task->on_token(std::string_view(slot.generated).substr(slot.n_sent, n_ready - slot.n_sent));
+            slot.n_sent = n_ready;
+        }
+        if (stopped) {
+            LOGi("slot %d: DONE, stop string after %d tokens", slot.id, slot.n_decoded);
+            release_slot(slot);
+            return;
+        }
+        if (!keep_going) {
+            LOGi("slot %d: stopped by the token consumer, n_decoded = %d", slot.id, slot.n_decoded);
+            release_slot(slot, "cancelled");
+            return;
+        }
+    }
+
+    slot.sampled = new_token_id;
+    slot.n_decoded++;
+
+    if (slot.n_decoded >= slot.n_len) {
+        LOGi("slot %d: DONE, reached n_len = %d", slot.id, slot.n_len);
+        release_slot(slot, "length");
+    }
+}
+
+LLM::Result LLM::slot_result(const Slot& slot) const {
+    Result result;
+    result.content = slot.generated;
+    result.reasoning = slot.reasoning;
+    result.prompt_tokens = slot.n_prompt;
+    result.cached_tokens = slot.n_cached;
+    result.completion_tokens = slot.n_decoded;
+    result.draft_tokens = slot.n_drafted;
+    result.draft_accepted = slot.n_draft_accepted;
+    result.finish_reason = slot.finish_reason;
+    result.error = slot.error;
+    result.bad_request = slot.bad_request;
+    return result;
+}
+
+LLM::Result LLM::error_result(const std::string& error, bool bad_request) {
+    Result result;
+    result.finish_reason = "error";
+    result.error = error;
+    result.bad_request = bad_request;
+    return result;
+}
+
+void LLM::finish(Task& task, const Result& result) {
+    task.result.set_value(result);
+    n_pending--;
+}
+
+void LLM::release_slot(Slot& slot, const char* finish_reason) {
+    auto conv = slot.conv;
+
+    if (slot.state == SLOT_DECODE && !conv->id.empty()) {
+        conv->message_pos.push_back(slot.n_prompt);
+        supply(*conv, slot.generated);
+        if (snapshots.enabled()) {
+            save_snapshot(slot);
+        }
+    } else if (slot.state != SLOT_DECODE && !conv->chat.empty()) {
+        // The turn never started or was stopped during its prompt, forget its user message
+        conv->chat.pop();
+        conv->message_pos.resize(std::min(conv->message_pos.size(), conv->chat.size()));
+        // Part of the prompt is in the KV cache, the next turn is placed by its cached prefix
+        if (slot.state == SLOT_PREFILL) {
+            conv->slot_id = -1;
+            conv->chat_history_len = 0;
+            slot.conv.reset();
+        }
+    }
+
+    release_sampler(slot);
+
+    // What was held back for a stop string that never completed is output after all
+    if (slot.n_sent < slot.generated.size() && slot.task->on_token && strcmp(finish_reason, "cancelled") != 0
+        && strcmp(finish_reason, "error") != 0) {
+        slot.task->on_token(std::string_view(slot.generated).substr(slot.n_sent));
+    }
+    slot.n_sent = slot.generated.size();
+
+    if (slot.n_drafted > 0) {
+        LOGi("slot %d: draft acceptance %d / %d (%.1f%%)", slot.id, slot.n_draft_accepted, slot.n_drafted,
+             100.0 * slot.n_draft_accepted / slot.n_drafted);
+    }
+
+    trace::instant<trace::LEVEL_REQUEST>(trace::REQUEST, slot.id, slot.n_prompt, slot.n_decoded);
+    conv->busy = false;
+    conv->t_last_used = llama_time_us();
+    slot.finish_reason = finish_reason;
+    finish(*slot.task, slot_result(slot));
+    slot.task.reset();
+    slot.state = SLOT_IDLE;
+    slot.prompt_tokens.clear();
+    slot.media.clear();
+    slot.t_last_used = llama_time_us();
+
+    // One-shot requests leave their KV behind for prefix reuse, only the conversation goes
+    if (conv->id.empty()) {
+        conv->slot_id = -1;
+        slot.conv.reset();
+    }
+}
+
+void LLM::fail_slot(Slot& slot, const std::string& error, bool bad_request) {
+    LOGe("slot %d: %s", slot.id, error.c_str());
+    slot.error = error;
+    slot.bad_request = bad_request;
+    release_slot(slot, "error");
+}
+
+void LLM::evict_slot(Slot& slot) {
+    if (slot.conv) {
+        slot.conv->slot_id = -1;
+        slot.conv->chat_history_len = 0;
+        slot.conv.reset();
+    }
+    llama_memory_seq_rm(llama_get_memory(context), slot.id, -1, -1);
+    slot.cache_tokens.clear();
+    slot.n_past = 0;
+}
+
+void LLM::supply(Conversation& conv, const std::string& text) {
+    if (!conv.chat.push("assistant", text)) {
+        LOGe("failed to apply the chat template\n");
+    }
+    conv.chat_history_len = conv.chat.text().size();
+}
+
 void LLM::log_callback(ggml_log_level level, const char * fmt, void * data) {
     if (level == GGML_LOG_LEVEL_ERROR)     fprintf(stderr, "ERROR: %s\n", fmt);
     else if (level == GGML_LOG_LEVEL_INFO) fprintf(stdout, "INFO: %s\n", fmt);
@@ -358,32 +1906,47 @@ void LLM::log_callback(ggml_log_level level, const char * fmt, void * data) {
     else fprintf(stdout, "%s\n", fmt);
 }
 
+static std::mutex backend_mutex;
+static int n_backend_users = 0;
+
 void LLM::backend_init() {
-    llama_backend_init();
+    std::lock_guard<std::mutex> lock(backend_mutex);
+    if (n_backend_users++ == 0) {
+        llama_backend_init();
+    }
 }
 
 void LLM::backend_free() {
-    llama_backend_free();
+    std::lock_guard<std::mutex> lock(backend_mutex);
+    if (--n_backend_users == 0) {
+        llama_backend_free();
+    }
 }
 
 void LLM::log_to_console() {
     llama_log_set(log_callback, NULL);
 }
 
-llama_context* LLM::new_context(llama_model* model) {
+llama_context* LLM::new_context(llama_model* model, const LLMConfig& config) {
     if (!model) {
         LOGe("new_context(): model cannot be null");
         return nullptr;
     }
 
-    int n_threads = std::max(1, std::min(8, (int) sysconf(_SC_NPROCESSORS_ONLN) - 2));
-    LOGi("Using %d threads", n_threads);
-
-    llama_context_params ctx_params = llama_context_default_params();
-
-    ctx_params.n_ctx           = 2048;
-    ctx_params.n_threads       = n_threads;
-    ctx_params.n_threads_batch = n_threads;
+    llama_context_params ctx_params = config.context_params(config.n_ctx * config.n_parallel, config.n_parallel);
+    if (config.embedding) {
+        // A batch of up to n_parallel inputs is all the context ever holds
+        ctx_params = config.context_params(config.n_batch, config.n_parallel);
+        char arch[64] = "";
+        char buf[16];
+        llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+        const std::string key = std::string(arch) + ".pooling_type";
+        if (ctx_params.pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED &&
+            (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) < 0 || atoi(buf) == LLAMA_POOLING_TYPE_NONE)) {
+            ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        }
+    }
+    LOGi("Using %d threads, %d for prefill", ctx_params.n_threads, ctx_params.n_threads_batch);
 
     llama_context * context = llama_new_context_with_model(model, ctx_params);
 
@@ -431,19 +1994,59 @@ void LLM::free_batch(llama_batch* batch) {
     delete batch;
 }
 
-llama_sampler* LLM::new_sampler() {
+LLM::SamplerParams LLM::sampler_params(const Options& options) {
+    SamplerParams params;
+    params.temp = options.temperature >= 0.0f ? options.temperature : 0.6f;
+    params.top_k = options.top_k >= 0 ? options.top_k : 20;
+    params.top_p = options.top_p >= 0.0f ? std::min(options.top_p, 1.0f) : 0.95f;
+    params.seed = options.seed;
+    return params;
+}
+
+llama_sampler* LLM::new_sampler(const SamplerParams& params, llama_sampler* grammar) {
     auto sparams = llama_sampler_chain_default_params();
     sparams.no_perf = true;
     llama_sampler * smpl = llama_sampler_chain_init(sparams);
+    // The grammar goes first so the rest of the chain only sees allowed tokens, the chain owns it
+    if (grammar) {
+        llama_sampler_chain_add(smpl, grammar);
+    }
+    if (params.temp <= 0.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+        return smpl;
+    }
     llama_sampler_chain_add(smpl, llama_sampler_init_min_p(0, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.6f));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(20));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.95,1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temp));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, 1));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(params.seed));
 
     return smpl;
 }
 
+llama_token LLM::argmax(const float* logits, int n) {
+    // The maximum is taken over 8 independent lanes so the loop vectorizes, then the first token
+    // holding it is looked up. Ties go to the lowest id like llama_sampler_init_greedy
+    float lanes[8];
+    std::fill(lanes, lanes + 8, -INFINITY);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            lanes[j] = logits[i + j] > lanes[j] ? logits[i + j] : lanes[j];
+        }
+    }
+    float best = *std::max_element(lanes, lanes + 8);
+    for (; i < n; i++) {
+        best = std::max(best, logits[i]);
+    }
+    for (int id = 0; id < n; id++) {
+        if (logits[id] == best) {
+            return id;
+        }
+    }
+    return 0;
+}
+
 void LLM::free_sampler(llama_sampler* sampler) {
     llama_sampler_free(sampler);
 }
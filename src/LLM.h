@@ -2,59 +2,344 @@
 #define LLM_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <tuple>
 #include "llama.h"
+#include "ggml-cpu.h"
 #include "mtmd.h"
+#include "common.h"
+#include "kv_snapshot_store.h"
+#include "chat_renderer.h"
+#include "llm_config.h"
+#include "kv_memory.h"
+#include "vision_cache.h"
+#include "worker_pool.h"
+#include "detokenizer.h"
 
 class LLM {
 public:
+    // Receives each generated piece (always complete UTF-8) on the scheduler thread as soon as it
+    // is sampled. The view is only valid during the call. Must not block; returning false stops
+    // the generation.
+    using TokenCallback = std::function<bool(std::string_view piece)>;
+
+    // Per-request generation options
+    struct Options {
+        std::string grammar;    // GBNF the output must match (root rule "root"), empty for free text
+        std::vector<std::string> images;    // encoded image files (PNG, JPEG...) in memory, shown before the text
+        std::string lora;       // adapter of the lora manifest to generate with, empty for the base model
+        std::vector<std::string> stop;      // strings that end the generation, not part of the output
+        int max_tokens;         // tokens generated at most, 0 for the default of 1280
+        int64_t timeout_ms;     // wall-clock limit from the call, time in the queue included, 0 for none
+        // Set by the caller to stop the request, e.g. when its client disconnects. Checked between
+        // decode steps, the slot is released right away
+        std::shared_ptr<std::atomic<bool>> cancel;
+        // Sampling, negative for the defaults (temperature 0.6, top_p 0.95, top_k 20). Temperature 0
+        // is greedy and deterministic
+        float temperature;
+        float top_p;
+        int top_k;
+        uint32_t seed;          // LLAMA_DEFAULT_SEED for a random one
+        // Models with <think> tokens: tokens of reasoning before </think> is forced, -1 for no
+        // limit. reasoning = false prefills an empty think block, as does a grammar
+        int max_thinking_tokens;
+        bool reasoning;
+        TokenCallback on_reasoning;     // receives the reasoning pieces, which on_token does not get
+
+        // Not member initializers, the methods below take Options() as a default argument
+        Options() : max_tokens(0), timeout_ms(0), temperature(-1.0f), top_p(-1.0f), top_k(-1), seed(LLAMA_DEFAULT_SEED),
+                    max_thinking_tokens(-1), reasoning(true) {}
+    };
+
+    // Outcome of one request
+    struct Result {
+        std::string content;        // the answer, without the think block
+        std::string reasoning;      // text of the think block
+        int prompt_tokens = 0;      // tokens of the prompt
+        int cached_tokens = 0;      // part of them reused from the KV cache
+        int completion_tokens = 0;
+        int draft_tokens = 0;       // speculative decoding: tokens proposed by the draft model
+        int draft_accepted = 0;     // and accepted by the target model
+        std::string finish_reason = "stop"; // stop, length, cancelled, timeout, or error if the request could not run
+        std::string error;          // what went wrong, for finish_reason "error"
+        bool bad_request = false;   // the error is in the request (prompt too long, invalid grammar,
+                                    // unreadable image) rather than in the server
+    };
+    // Result of a request that could not run
+    static Result error_result(const std::string& error, bool bad_request);
+
     LLM();
     ~LLM();
 
-    bool load(const std::string& model_path, const std::string& mmproj_path, int gpu_layers);
+    bool load(const LLMConfig& config);
+    // Called on the scheduler thread with the id of every conversation forgotten for being idle,
+    // set before load()
+    void set_conversation_expired(std::function<void(const std::string& conversation_id)> callback) { on_conversation_expired = std::move(callback); }
+    // draft_model_path enables speculative decoding with a small model sharing the vocabulary
+    bool load(const std::string& model_path, const std::string& mmproj_path, int gpu_layers, int n_parallel = 8, const std::string& draft_model_path = "");
     void unload();
-    std::string send(const std::string& user_input, const std::string& image_path = "");
+    // Persist every finished turn of a conversation to dir so it can be resumed after a restart or
+    // eviction by loading its KV state instead of prefilling the history again
+    bool enable_snapshots(const std::string& dir, uint64_t max_bytes);
+    // When a conversation outgrows its slot, drop its oldest turns from the KV cache and shift the
+    // rest down, keeping leading system/tool messages. Disabled, such a request is rejected
+    void set_context_shift(bool enabled) { context_shift = enabled; }
+    // Thread-safe. Every in-flight call gets its own sequence in the shared context and is
+    // decoded together with the others. A non-empty conversation_id keeps the chat history
+    // (and its KV) between calls, an empty one is a one-shot request.
+    std::string send(const std::string& user_input, const std::string& image_path = "", const std::string& conversation_id = "", const Options& options = Options());
+    // Same as send(), streaming every piece through on_token before returning the full text
+    std::string send_stream(const std::string& user_input, const TokenCallback& on_token, const std::string& image_path = "", const std::string& conversation_id = "", const Options& options = Options());
+    // Queues the request and returns immediately, the future is ready once generation ends
+    std::future<Result> send_async(const std::string& user_input, TokenCallback on_token, const std::string& image_path = "", const std::string& conversation_id = "", const Options& options = Options());
+    // Embeddings mode: the pooled, L2-normalized embedding of every input. Inputs are packed into
+    // batches of n_batch tokens and n_parallel sequences. Runs on the calling thread, one call at a time.
+    // On failure bad_request tells inputs that cannot be embedded from errors of the server
+    bool embed(const std::vector<std::string>& inputs, std::vector<std::vector<float>>& embeddings, int& n_tokens, std::string& error, bool& bad_request);
+    // Requests queued or being generated, a measure of how busy this instance is
+    int pending() const { return n_pending.load(); }
+    // KV cache size per token and session, and how many sessions the budget allows
+    const KVMemory& kv_memory() const { return kv_memory_info; }
+    // Weights of the model and the draft model plus the KV cache, what unloading gives back
+    uint64_t memory_bytes() const;
+    // Names of the LoRA adapters requests can choose from
+    std::vector<std::string> lora_names() const;
 
 private:
+    struct Conversation {
+        std::string id;
+        ChatRenderer chat;
+        int chat_history_len = 0;   // formatted chars of the history that is already in the KV cache
+        std::vector<int> message_pos;   // token position in the sequence where each message's content starts
+        int slot_id = -1;           // slot holding this conversation's KV, -1 if not resident
+        bool busy = false;          // a request of this conversation is being processed
+        int64_t t_last_used = 0;    // llama_time_us() of its last turn
+    };
+
+    // An image of the prompt. Its chunk is encoded on encode_pool while the text in front of it is
+    // prefilled, the embedding is decoded once the prefill reaches pos
+    struct Media {
+        size_t pos;                                 // index of its first placeholder in prompt_tokens
+        llama_pos n_pos;                            // positions it takes in the sequence
+        std::shared_ptr<mtmd_input_chunk> chunk;
+        std::string key;                            // of its embedding in vision_cache, per image and slice
+        std::future<std::shared_ptr<const std::vector<float>>> embd;  // nullptr if encoding failed
+    };
+
+    // The images of a request decoded, preprocessed and tokenized by mtmd_tokenize on image_pool,
+    // the scheduler only splices them into the prompt
+    struct PreparedMedia {
+        bool ok = false;
+        std::vector<llama_token> tokens;    // wrapper tokens and a run of placeholders per image
+        std::vector<Media> media;           // pos is relative to tokens
+    };
+
+    struct Task {
+        std::string user_input;
+        std::string image_path;
+        std::string conversation_id;
+        int n_len;
+        int lora = -1;          // index in adapters, -1 for the base model
+        int64_t t_deadline = 0; // llama_time_us() at which the request is stopped, 0 for none
+        Options options;
+        TokenCallback on_token;
+        std::future<std::shared_ptr<PreparedMedia>> media;  // Options::images and image_path, not valid() without images
+        std::promise<Result> result;
+    };
+
+    // Settings of a sampler chain, the key of the pool of idle chains
+    struct SamplerParams {
+        float temp;
+        int top_k;
+        float top_p;
+        uint32_t seed;
+        bool operator<(const SamplerParams& other) const {
+            return std::tie(temp, top_k, top_p, seed) < std::tie(other.temp, other.top_k, other.top_p, other.seed);
+        }
+    };
+
+    enum SlotState {
+        SLOT_IDLE,
+        SLOT_PREFILL,   // prompt tokens waiting to be decoded, n_batch at most per step
+        SLOT_DECODE,    // one sampled token per step
+    };
+
+    struct Slot {
+        llama_seq_id id = 0;
+        SlotState state = SLOT_IDLE;
+        std::shared_ptr<Task> task;
+        std::shared_ptr<Conversation> conv;
+        std::vector<llama_token> cache_tokens;  // tokens currently in this sequence's KV cache, kept after
+                                                // the request ends so later prompts can reuse its prefix
+        std::vector<llama_token> prompt_tokens; // prompt of the current turn, images as runs of placeholders
+        std::vector<Media> media;               // images of the prompt not decoded yet, in order
+        size_t n_prompt_done = 0;               // prompt tokens already in the KV cache
+        llama_pos n_past = 0;
+        llama_token sampled = 0;                // sampled but not yet decoded
+        int lora = -1;                          // adapter the KV of this sequence was computed with
+        int n_decoded = 0;
+        int n_len = 0;                          // tokens the turn may generate, max_tokens cut to the room left
+        int n_prompt = 0;
+        int n_cached = 0;
+        int i_batch = -1;                       // index of this slot's logits in the current batch
+        std::vector<llama_token> draft;         // speculative tokens verified in the current batch after sampled
+        std::vector<llama_token> draft_cache;   // tokens in this sequence of the draft context
+        int i_draft = -1;                       // index of this slot's logits in the draft batch
+        int n_drafted = 0;
+        int n_draft_accepted = 0;
+        llama_sampler* sampler = nullptr;       // chain of the current request, nullptr for greedy without a grammar
+        SamplerParams sampler_params = {};
+        bool sampler_pooled = false;            // goes back to sampler_pool when the request ends
+        std::string cached_token_chars;         // pieces ending inside a UTF-8 character, not output yet
+        Utf8Stream utf8;
+        std::string generated;
+        std::string reasoning;
+        int think_state = 0;                    // 0 no think block yet, 1 inside one, 2 closed
+        int n_thinking = 0;                     // tokens generated inside the think block
+        size_t n_sent = 0;                      // chars of generated passed to on_token, the rest may be a stop string
+        const char* finish_reason = "stop";
+        std::string error;                      // set by fail_slot
+        bool bad_request = false;
+        int64_t t_last_used = 0;
+    };
+
+    LLMConfig config;
     llama_model* model;
     llama_context* context;
     llama_batch* batch;
-    llama_sampler* sampler;
+    int n_batch;
+    int n_ctx_slot;
+    bool context_shift;
+    bool backend_ready;     // holds a reference on the process-wide backend, see backend_init()
+    KVMemory kv_memory_info;
+
+    // Explicit threadpools: a wide one for steps with prompt tokens, a narrow pinned one for steps
+    // that only decode. Both are paused while there is nothing to do
+    ggml_threadpool* threadpool;
+    ggml_threadpool* threadpool_batch;
+    int threadpool_mode;        // -1 none attached yet, 0 decode, 1 prefill
+    bool threadpools_paused;
+
+    // Speculative decoding, the draft context mirrors the slots' sequences
+    llama_model* draft_model;
+    llama_context* draft_context;
+    llama_batch* draft_batch;
+    common_params_speculative spec_params;
+
+    // Think block delimiters when the vocabulary has them as single tokens, LLAMA_TOKEN_NULL otherwise
+    llama_token think_start;
+    llama_token think_end;
+
+    // Text of each token, process_token copies from it instead of converting every sampled token
+    PieceCache pieces;
+
+    // LoRA adapters, one set on the context at a time. Each step decodes only the slots of the
+    // active adapter, which stays for up to LORA_STEPS steps while other adapters have work
+    struct Adapter {
+        std::string name;
+        llama_adapter_lora* adapter;
+        float scale;
+    };
+    std::vector<Adapter> adapters;
+    int active_lora;
+    int lora_steps;
 
     // Vision model members
     mtmd::context_ptr ctx_vision;
-    mtmd::bitmaps bitmaps;
+    VisionCache vision_cache;
+    WorkerPool image_pool;      // decodes request images while the scheduler keeps going
+    WorkerPool encode_pool;     // runs the vision encoder, one image at a time
+
+    // Scheduler state, slots and conversations are only touched by the worker thread
+    std::vector<Slot> slots;
+    std::map<std::string, std::shared_ptr<Conversation>> conversations;
+    int64_t t_expired = 0;      // llama_time_us() of the last expire_conversations() sweep
+    std::function<void(const std::string&)> on_conversation_expired;
+    std::deque<std::shared_ptr<Task>> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::thread worker;
+    bool running;
+    uint64_t n_events = 0;      // requests queued and images decoded or encoded, wakes up the scheduler
+    std::atomic<int> n_pending;
+
+    KVSnapshotStore snapshots;
+    std::mutex embed_mutex;
 
-    // Internal state
-    std::vector<llama_chat_message> messages;
-    int prev_tokens_len;
-    int chat_history_tokens_len;
-    std::string cached_token_chars;
+    // Parsed grammars by GBNF text, requests get a clone instead of parsing again
+    std::map<std::string, llama_sampler*> grammar_cache;
+    // Idle sampler chains by settings, reset and handed to the next request with the same ones
+    std::map<SamplerParams, std::vector<llama_sampler*>> sampler_pool;
 
 
     // Internal helper functions
     void init_vision_context(const char * mmprojPath,int gpu,llama_model * model,int verbosity=0);
-    bool load_media(const char * fname);
-    bool check_vision_ready();
-    int completion_init_vision(const char* text, bool format_chat, int n_len, const char* picf);
-    int completion_init(const char* text, bool format_chat, int n_len);
-    std::string completion_loop(int n_len);
-    void kv_cache_clear();
-    void supply(const char* text);
+    std::shared_ptr<PreparedMedia> prepare_media(std::vector<mtmd::bitmap>& bitmaps);
+    void encode_media(Media& media);
+    bool decode_media(Slot& slot);
+    void notify_scheduler();
+    bool load_adapters(const std::string& manifest);
+    void select_lora();
+    bool has_work(const Slot& slot) const;
+    void loop();
+    bool has_active_slots() const;
+    bool has_idle_slot() const;
+    void cancel_tasks();
+    void assign_tasks();
+    Slot* find_slot(const std::vector<llama_token>& tokens, int lora);
+    size_t reuse_prefix(Slot& slot, const std::vector<llama_token>& tokens);
+    bool restore_snapshot(const std::shared_ptr<Conversation>& conv, int lora);
+    void save_snapshot(const Slot& slot);
+    bool launch_slot(const std::shared_ptr<Task>& task, const std::shared_ptr<Conversation>& conv);
+    std::vector<llama_token> tokenize_turns(Conversation& conv, const std::string& text, size_t first, size_t base, bool add_special);
+    bool shift_context(Slot& slot, Conversation& conv, std::vector<llama_token>& tokens, int n_len);
+    bool update_slots();
+    llama_sampler* grammar_sampler(const std::string& gbnf);
+    llama_sampler* acquire_sampler(const SamplerParams& params);
+    void release_sampler(Slot& slot);
+    llama_token sample(Slot& slot, int idx);
+    bool load_draft();
+    bool new_threadpools();
+    void use_threadpool(bool prefill);
+    void pause_threadpools(bool pause);
+    void draft_tokens();
+    void verify_draft(Slot& slot);
+    void process_token(Slot& slot, llama_token new_token_id);
+    Result slot_result(const Slot& slot) const;
+    void finish(Task& task, const Result& result);
+    void release_slot(Slot& slot, const char* finish_reason = "stop");
+    void fail_slot(Slot& slot, const std::string& error, bool bad_request);
+    void evict_slot(Slot& slot);
+    void expire_conversations();
+    void supply(Conversation& conv, const std::string& text);
 
     // Static helper functions
-    static bool is_valid_utf8(const char * string);
+    static bool is_placeholder(llama_token token) { return token < LLAMA_TOKEN_NULL; }
     static void log_callback(ggml_log_level level, const char * fmt, void * data);
+    // llama_backend_init/llama_backend_free are process-wide, they are reference counted so one
+    // instance unloading (a NUMA node, an evicted model) leaves the others running
     static void backend_init();
     static void backend_free();
     static void log_to_console();
-    static llama_context* new_context(llama_model* model);
+    static llama_context* new_context(llama_model* model, const LLMConfig& config);
     static void free_model(llama_model* model);
     static llama_batch* new_batch(int n_tokens, int embd, int n_seq_max);
     static void free_batch(llama_batch* batch);
-    static llama_sampler* new_sampler();
+    static SamplerParams sampler_params(const Options& options);
+    static llama_sampler* new_sampler(const SamplerParams& params, llama_sampler* grammar = nullptr);
+    static llama_token argmax(const float* logits, int n);
     static void free_sampler(llama_sampler* sampler);
     static void free_context(llama_context* context);
 };
 
-#endif // LLM_H
\ No newline at end of file
+#endif // LLM_H
@@ -24,8 +24,8 @@ json extract_json_from_response(const std::string& text) {
             // Search for the first '{' after the think block
             start = text.find("{", think_end);
         } else {
-            // As a last resort, find the last '{' in the entire string
-            start = text.rfind("{");
+            // The server returns the answer without the think block, the JSON starts at the first '{'
+            start = text.find("{");
         }
     }
 
@@ -47,6 +47,33 @@ json extract_json_from_response(const std::string& text) {
     }
 }
 
+// 把 /help 返回的端点描述转换成 tools（JSON schema 描述参数），LLM 服务据此用语法约束输出
+json build_tools_from_help(const json& help) {
+    json tools = json::array();
+    for (const auto& endpoint : help["endpoints"]) {
+        json params = json::object();
+        if (endpoint.contains("request_body")) {
+            params = endpoint["request_body"].value("schema", json::object());
+        } else if (endpoint.contains("query_parameters")) {
+            params = endpoint["query_parameters"];
+        }
+
+        json properties = json::object();
+        json required = json::array();
+        for (const auto& param : params.items()) {
+            properties[param.key()] = {{"type", "string"}, {"description", param.value()}};
+            required.push_back(param.key());
+        }
+
+        tools.push_back({
+            {"name", endpoint["path"]},
+            {"description", endpoint.value("description", "")},
+            {"parameters", {{"type", "object"}, {"properties", properties}, {"required", required}}},
+        });
+    }
+    return tools;
+}
+
 int main(int argc, char* argv[]) {
     // 创建HTTP客户端访问MCP和LLM的服务
     httplib::Client mcp_client(MCP_SERVICE_URL);
@@ -95,7 +122,8 @@ int main(int argc, char* argv[]) {
         json llm_req_body;
         llm_req_body["model"] = "my-llm";
         llm_req_body["messages"] = prompt_for_tool_selection;
-        
+        llm_req_body["tools"] = build_tools_from_help(tools_json);
+
         auto llm_res1 = llm_client.Post("/v1/chat/completions", llm_req_body.dump(), "application/json");
         if (!llm_res1 || llm_res1->status != 200) {
             std::cerr << "[Agent] Error: LLM service returned an error." << std::endl;
@@ -150,6 +178,7 @@ int main(int argc, char* argv[]) {
             "Now, please provide a final response to the user.";
 
         llm_req_body["messages"] = prompt_for_final_answer;
+        llm_req_body.erase("tools");
         auto llm_res2 = llm_client.Post("/v1/chat/completions", llm_req_body.dump(), "application/json");
         if (!llm_res2 || llm_res2->status != 200) {
             std::cerr << "[Agent] Error: LLM service returned an error on final response generation." << std::endl;
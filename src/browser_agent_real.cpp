@@ -90,7 +90,8 @@ void sse_worker_thread(SharedState& state) {
 }
 
 json extract_json_from_response(const std::string& text) {
-    size_t start = text.rfind("{");
+    // The answer comes without the think block, the JSON starts at its first '{'
+    size_t start = text.find("{");
     if (start == std::string::npos) throw std::runtime_error("Could not find start of JSON");
     size_t end = text.rfind("}");
     if (end == std::string::npos || end < start) throw std::runtime_error("Could not find end of JSON");
@@ -164,7 +165,8 @@ int main() {
             "--- AVAILABLE TOOLS ---\n" + available_tools.dump(2) + "\n\n"
             "Respond with JSON only.";
 
-        json llm_req_body = {{"model", "my-llm"}, {"messages", prompt_for_tool_selection}};
+        // MCP 工具自带 inputSchema，直接作为 tools 传给 LLM 服务做语法约束
+        json llm_req_body = {{"model", "my-llm"}, {"messages", prompt_for_tool_selection}, {"tools", available_tools}};
         httplib::Headers llm_headers;
         auto llm_res = llm_client.Post("/v1/chat/completions", llm_headers, llm_req_body.dump(), "application/json");
         if (!llm_res || llm_res->status != 200) { std::cerr << "[Agent] Error: LLM service failed." << std::endl; continue; }
@@ -216,6 +218,7 @@ int main() {
             "Provide a final response.";
 
         llm_req_body["messages"] = prompt_for_final_answer;
+        llm_req_body.erase("tools");
         auto llm_res2 = llm_client.Post("/v1/chat/completions", llm_headers, llm_req_body.dump(), "application/json");
         if (!llm_res2 || llm_res2->status != 200) { std::cerr << "[Agent] Error: LLM service failed on final response." << std::endl; continue; }
         
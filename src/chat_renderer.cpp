@@ -0,0 +1,128 @@
+#include "chat_renderer.h"
+#include <algorithm>
+#include <cstring>
+
+ChatRenderer::ChatRenderer() : tmpl(nullptr), block_used(0) {}
+
+const char* ChatRenderer::store(const std::string& str) {
+    const size_t n = str.size() + 1;
+    if (blocks.empty() || block_used + n > block_sizes.back()) {
+        const size_t size = std::max(BLOCK_SIZE, n);
+        blocks.emplace_back(new char[size]);
+        block_sizes.push_back(size);
+        block_used = 0;
+    }
+    char* dst = blocks.back().get() + block_used;
+    memcpy(dst, str.c_str(), n);
+    block_used += n;
+    return dst;
+}
+
+bool ChatRenderer::render(const std::vector<llama_chat_message>& msgs, bool add_ass, std::string& out) const {
+    out.resize(std::max<size_t>(out.capacity(), 256));
+    int32_t n = llama_chat_apply_template(tmpl, msgs.data(), msgs.size(), add_ass, &out[0], out.size());
+    if (n > (int32_t) out.size()) {
+        out.resize(n);
+        n = llama_chat_apply_template(tmpl, msgs.data(), msgs.size(), add_ass, &out[0], out.size());
+    }
+    if (n < 0) {
+        out.clear();
+        return false;
+    }
+    out.resize(n);
+    return true;
+}
+
+bool ChatRenderer::render_turn(size_t i, std::string& out) const {
+    // Some templates merge a system message into the turn after it (e.g. gemma), the first turns
+    // are rendered together with what comes before them
+    if (i == 0 || strcmp(messages[i - 1].role, "system") == 0) {
+        std::vector<llama_chat_message> head(messages.begin(), messages.begin() + i + 1);
+        if (!render(head, false, out) || out.compare(0, rendered.size(), rendered) != 0) {
+            return false;
+        }
+        out.erase(0, rendered.size());
+        return true;
+    }
+
+    // The separator in front of a turn only depends on the role before it, an empty message of
+    // that role stands in for the history
+    const llama_chat_message prev = {messages[i - 1].role, ""};
+    std::string head;
+    if (!render({prev}, false, head) || !render({prev, messages[i]}, false, out)) {
+        return false;
+    }
+    if (out.compare(0, head.size(), head) != 0) {
+        return false;
+    }
+    out.erase(0, head.size());
+    return true;
+}
+
+bool ChatRenderer::push(const std::string& role, const std::string& content) {
+    marks.push_back({blocks.empty() ? 0 : blocks.size() - 1, block_used});
+    messages.push_back({store(role), store(content)});
+
+    std::string turn;
+    if (render_turn(messages.size() - 1, turn)) {
+        rendered += turn;
+    } else {
+        // Templates whose turns depend on more than the previous role get the full history
+        std::string full;
+        if (!render(messages, false, full)) {
+            pop();
+            return false;
+        }
+        rendered = std::move(full);
+    }
+    turn_end.push_back(rendered.size());
+    return true;
+}
+
+void ChatRenderer::pop() {
+    if (messages.empty()) {
+        return;
+    }
+    const Mark mark = marks.back();
+    marks.pop_back();
+    messages.pop_back();
+    if (turn_end.size() > messages.size()) {
+        turn_end.pop_back();
+    }
+    rendered.resize(text_length(messages.size()));
+
+    // Everything stored after the mark belongs to the removed message
+    if (!blocks.empty()) {
+        blocks.resize(mark.block + 1);
+        block_sizes.resize(mark.block + 1);
+        block_used = mark.used;
+    }
+}
+
+bool ChatRenderer::erase(size_t first, size_t last) {
+    ChatRenderer kept;
+    kept.set_template(tmpl);
+    for (size_t i = 0; i < messages.size(); i++) {
+        if ((i < first || i >= last) && !kept.push(messages[i].role, messages[i].content)) {
+            return false;
+        }
+    }
+    *this = std::move(kept);
+    return true;
+}
+
+std::string ChatRenderer::generation_prompt() const {
+    if (messages.empty()) {
+        return "";
+    }
+    const llama_chat_message last = {messages.back().role, ""};
+    std::string without;
+    std::string with;
+    if (render({last}, false, without) && render({last}, true, with) && with.compare(0, without.size(), without) == 0) {
+        return with.substr(without.size());
+    }
+    if (render(messages, true, with) && with.compare(0, rendered.size(), rendered) == 0) {
+        return with.substr(rendered.size());
+    }
+    return "";
+}
@@ -0,0 +1,61 @@
+#ifndef CHAT_RENDERER_H
+#define CHAT_RENDERER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "llama.h"
+
+// Chat history of one conversation together with its formatted text. Appending a message only
+// renders the new turn, against an empty message of the previous role, so a turn costs
+// O(new message) instead of O(history). Message text lives in an arena owned by the renderer and
+// is freed with it.
+class ChatRenderer {
+public:
+    ChatRenderer();
+
+    // Template as returned by llama_model_chat_template, nullptr for the default one
+    void set_template(const char* tmpl) { this->tmpl = tmpl; }
+
+    size_t size() const { return messages.size(); }
+    bool empty() const { return messages.empty(); }
+    const llama_chat_message& operator[](size_t i) const { return messages[i]; }
+    const llama_chat_message& back() const { return messages.back(); }
+
+    // Appends a message and its formatted turn, false if the template cannot be applied
+    bool push(const std::string& role, const std::string& content);
+    // Removes the last message
+    void pop();
+    // Removes messages [first, last), the remaining history is rendered again into a fresh arena
+    bool erase(size_t first, size_t last);
+
+    // Formatted history, without the generation prompt
+    const std::string& text() const { return rendered; }
+    // Length of text() covering the first n messages
+    size_t text_length(size_t n) const { return n == 0 ? 0 : turn_end[n - 1]; }
+    // What the template appends to text() to start the assistant's answer
+    std::string generation_prompt() const;
+
+private:
+    struct Mark {
+        size_t block;
+        size_t used;
+    };
+
+    const char* tmpl;
+    std::vector<llama_chat_message> messages;
+    std::vector<size_t> turn_end;   // text length after each message
+    std::vector<Mark> marks;        // arena position before each message, pop() rolls back to it
+    std::string rendered;
+
+    static constexpr size_t BLOCK_SIZE = 16 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> block_sizes;
+    size_t block_used;
+
+    const char* store(const std::string& str);
+    bool render(const std::vector<llama_chat_message>& msgs, bool add_ass, std::string& out) const;
+    bool render_turn(size_t i, std::string& out) const;
+};
+
+#endif // CHAT_RENDERER_H
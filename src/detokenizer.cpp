@@ -0,0 +1,24 @@
+#include "detokenizer.h"
+
+void PieceCache::build(const llama_vocab* vocab) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    bytes.clear();
+    bytes.reserve(n_vocab * 8);
+    offsets.resize(n_vocab + 1);
+
+    char buf[256];
+    for (llama_token token = 0; token < n_vocab; token++) {
+        offsets[token] = bytes.size();
+        int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+        if (n >= 0) {
+            bytes.append(buf, n);
+        } else {
+            // Longer than any piece should be, converted straight into the buffer
+            const size_t at = bytes.size();
+            bytes.resize(at - n);
+            llama_token_to_piece(vocab, token, &bytes[at], -n, 0, true);
+        }
+    }
+    offsets[n_vocab] = bytes.size();
+    bytes.shrink_to_fit();
+}
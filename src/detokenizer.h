@@ -0,0 +1,52 @@
+#ifndef DETOKENIZER_H
+#define DETOKENIZER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+
+// Text of every token of a vocabulary, converted once when the model is loaded and stored back to
+// back in one buffer. Looking a token up is two loads, nothing is allocated per generated token.
+class PieceCache {
+public:
+    // Converts the whole vocabulary, special tokens rendered as text like common_token_to_piece
+    void build(const llama_vocab* vocab);
+    bool empty() const { return offsets.empty(); }
+    size_t n_bytes() const { return bytes.size(); }
+
+    // Valid as long as the cache is not rebuilt
+    std::string_view get(llama_token token) const {
+        return std::string_view(bytes.data() + offsets[token], offsets[token + 1] - offsets[token]);
+    }
+
+private:
+    std::string bytes;
+    std::vector<uint32_t> offsets;  // n_vocab + 1, the piece of token t is [offsets[t], offsets[t + 1])
+};
+
+// Whether UTF-8 text fed in pieces ends on a character boundary, tracked across pieces so only the
+// new bytes are looked at. Invalid bytes count as complete characters, they are passed on rather
+// than held back forever.
+class Utf8Stream {
+public:
+    // True if the text fed so far can be output without splitting a character
+    bool feed(std::string_view bytes) {
+        for (unsigned char c : bytes) {
+            if (need > 0 && (c & 0xC0) == 0x80) {
+                need--;
+            } else {
+                // A new character, or one cut short: either way the sequence starts over here
+                need = c < 0xC0 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : c < 0xF8 ? 3 : 0;
+            }
+        }
+        return need == 0;
+    }
+    void reset() { need = 0; }
+
+private:
+    int need = 0;   // continuation bytes still missing from the last character
+};
+
+#endif // DETOKENIZER_H
@@ -0,0 +1,354 @@
+#include "json_schema_grammar.h"
+#include <map>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdexcept>
+
+using json = nlohmann::json;
+
+static const char* PRIMITIVE_RULES[][2] = {
+    {"space",         "| \" \" | \"\\n\" [ \\t]{0,20}"},
+    {"boolean",       "(\"true\" | \"false\") space"},
+    {"null",          "\"null\" space"},
+    {"integral-part", "[0] | [1-9] [0-9]{0,15}"},
+    {"decimal-part",  "[0-9]{1,16}"},
+    {"integer",       "(\"-\"? integral-part) space"},
+    {"number",        "(\"-\"? integral-part) (\".\" decimal-part)? ([eE] [-+]? integral-part)? space"},
+    {"char",          "[^\"\\\\\\x7F\\x00-\\x1F] | [\\\\] ([\"\\\\bfnrt] | \"u\" [0-9a-fA-F]{4})"},
+    {"string",        "\"\\\"\" char* \"\\\"\" space"},
+    {"object",        "\"{\" space ( string \":\" space value (\",\" space string \":\" space value)* )? \"}\" space"},
+    {"array",         "\"[\" space ( value (\",\" space value)* )? \"]\" space"},
+    {"value",         "object | array | string | number | boolean | null"},
+};
+
+class SchemaConverter {
+public:
+    explicit SchemaConverter(const json& root) : root(root) {}
+
+    std::string convert() {
+        std::string body = visit(root, "root");
+        if (body != "root") {
+            rules["root"] = body;
+        }
+
+        std::string out;
+        for (const auto& rule : rules) {
+            out += rule.first + " ::= " + rule.second + "\n";
+        }
+        return out;
+    }
+
+private:
+    const json& root;
+    std::map<std::string, std::string> rules;
+    std::set<std::string> refs_in_progress;
+
+    static std::string sanitize(const std::string& name) {
+        std::string out;
+        for (char c : name) {
+            out += (isalnum((unsigned char) c) || c == '-') ? c : '-';
+        }
+        return out;
+    }
+
+    static std::string literal(const std::string& text) {
+        std::string out = "\"";
+        for (char c : text) {
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n";  break;
+                case '\r': out += "\\r";  break;
+                case '\t': out += "\\t";  break;
+                default:   out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+    // A JSON value as a literal followed by optional space
+    static std::string value_literal(const json& value) {
+        return literal(value.dump()) + " space";
+    }
+
+    std::string add_rule(const std::string& name, const std::string& body) {
+        std::string key = sanitize(name);
+        auto it = rules.find(key);
+        if (it == rules.end() || it->second == body) {
+            rules[key] = body;
+            return key;
+        }
+        for (int i = 0;; i++) {
+            std::string candidate = key + std::to_string(i);
+            auto found = rules.find(candidate);
+            if (found == rules.end() || found->second == body) {
+                rules[candidate] = body;
+                return candidate;
+            }
+        }
+    }
+
+    std::string primitive(const std::string& name) {
+        // Pulls in the rule and everything it depends on
+        static const std::map<std::string, std::vector<std::string>> deps = {
+            {"boolean", {"space"}},
+            {"null",    {"space"}},
+            {"integer", {"integral-part", "space"}},
+            {"number",  {"integral-part", "decimal-part", "space"}},
+            {"string",  {"char", "space"}},
+            {"object",  {"string", "value", "space"}},
+            {"array",   {"value", "space"}},
+            {"value",   {"object", "array", "string", "number", "boolean", "null"}},
+        };
+        if (rules.count(name)) {
+            return name;
+        }
+        for (const auto& rule : PRIMITIVE_RULES) {
+            if (name == rule[0]) {
+                rules[name] = rule[1];
+            }
+        }
+        auto it = deps.find(name);
+        if (it != deps.end()) {
+            for (const auto& dep : it->second) {
+                primitive(dep);
+            }
+        }
+        return name;
+    }
+
+    const json& resolve_ref(const std::string& ref) {
+        if (ref.rfind("#/", 0) != 0) {
+            throw std::invalid_argument("only local $ref is supported: " + ref);
+        }
+        const json* node = &root;
+        size_t pos = 2;
+        while (pos <= ref.size()) {
+            size_t end = ref.find('/', pos);
+            if (end == std::string::npos) {
+                end = ref.size();
+            }
+            std::string key = ref.substr(pos, end - pos);
+            if (!node->is_object() || !node->contains(key)) {
+                throw std::invalid_argument("unresolved $ref: " + ref);
+            }
+            node = &(*node)[key];
+            pos = end + 1;
+        }
+        return *node;
+    }
+
+    std::string visit_alternatives(const json& alternatives, const std::string& name) {
+        std::string body;
+        for (size_t i = 0; i < alternatives.size(); i++) {
+            if (i > 0) {
+                body += " | ";
+            }
+            body += visit(alternatives[i], name + "-" + std::to_string(i));
+        }
+        return body;
+    }
+
+    // Optional properties as a chain, so commas only appear between present ones
+    std::string optional_chain(const std::vector<std::string>& keys, size_t first, bool first_is_optional,
+                               const std::map<std::string, std::string>& kv_rules, const std::string& name) {
+        const std::string& kv = kv_rules.at(keys[first]);
+        std::string body = first_is_optional ? "( \",\" space " + kv + " )?" : kv;
+        if (first + 1 < keys.size()) {
+            body += " " + add_rule(name + "-" + keys[first] + "-rest",
+                                   optional_chain(keys, first + 1, true, kv_rules, name));
+        }
+        return body;
+    }
+
+    std::string visit_object(const json& schema, const std::string& name) {
+        if (!schema.contains("properties") || schema["properties"].empty()) {
+            return primitive("object");
+        }
+
+        const json& properties = schema["properties"];
+        primitive("space");
+
+        // Required keys keep the order of "required", so e.g. tool_name comes before parameters
+        std::vector<std::string> required_keys;
+        std::vector<std::string> optional_keys;
+        if (schema.contains("required")) {
+            for (const auto& key : schema["required"]) {
+                if (properties.contains(key.get<std::string>())) {
+                    required_keys.push_back(key.get<std::string>());
+                }
+            }
+        }
+
+        std::map<std::string, std::string> kv_rules;
+        for (const auto& prop : properties.items()) {
+            std::string value_rule = visit(prop.value(), name + "-" + prop.key());
+            kv_rules[prop.key()] = add_rule(name + "-" + prop.key() + "-kv",
+                                            value_literal(prop.key()) + " \":\" space " + value_rule);
+            if (std::find(required_keys.begin(), required_keys.end(), prop.key()) == required_keys.end()) {
+                optional_keys.push_back(prop.key());
+            }
+        }
+
+        std::string body = "\"{\" space ";
+        for (size_t i = 0; i < required_keys.size(); i++) {
+            if (i > 0) {
+                body += " \",\" space ";
+            }
+            body += kv_rules[required_keys[i]];
+        }
+        if (!optional_keys.empty()) {
+            std::string alternatives;
+            for (size_t i = 0; i < optional_keys.size(); i++) {
+                if (i > 0) {
+                    alternatives += " | ";
+                }
+                alternatives += optional_chain(optional_keys, i, false, kv_rules, name);
+            }
+            if (required_keys.empty()) {
+                body += "( " + alternatives + " )?";
+            } else {
+                body += " ( \",\" space ( " + alternatives + " ) )?";
+            }
+        }
+        return body + " \"}\" space";
+    }
+
+    std::string visit_array(const json& schema, const std::string& name) {
+        primitive("space");
+        std::string item = schema.contains("items") ? visit(schema["items"], name + "-item") : primitive("value");
+        int min_items = schema.value("minItems", 0);
+        int max_items = schema.value("maxItems", -1);
+
+        std::string rest = "(\",\" space " + item + ")";
+        std::string inner;
+        if (max_items < 0) {
+            inner = item + " " + rest + (min_items > 1 ? "{" + std::to_string(min_items - 1) + ",}" : "*");
+        } else if (max_items == 0) {
+            return "\"[\" space \"]\" space";
+        } else {
+            inner = item + " " + rest + "{" + std::to_string(std::max(0, min_items - 1)) + "," + std::to_string(max_items - 1) + "}";
+        }
+        if (min_items == 0) {
+            inner = "( " + inner + " )?";
+        }
+        return "\"[\" space " + inner + " \"]\" space";
+    }
+
+    std::string visit_string(const json& schema) {
+        int min_length = schema.value("minLength", 0);
+        int max_length = schema.value("maxLength", -1);
+        if (min_length == 0 && max_length < 0) {
+            return primitive("string");
+        }
+        primitive("char");
+        primitive("space");
+        std::string repeat = "{" + std::to_string(min_length) + "," + (max_length >= 0 ? std::to_string(max_length) : "") + "}";
+        return "\"\\\"\" char" + repeat + " \"\\\"\" space";
+    }
+
+    std::string visit(const json& schema, const std::string& name) {
+        if (schema.is_boolean()) {
+            if (!schema.get<bool>()) {
+                throw std::invalid_argument("schema 'false' cannot be matched");
+            }
+            return primitive("value");
+        }
+        if (!schema.is_object()) {
+            throw std::invalid_argument("schema must be an object");
+        }
+
+        if (schema.contains("$ref")) {
+            std::string ref = schema["$ref"];
+            std::string rule_name = sanitize("ref-" + ref.substr(ref.rfind('/') + 1));
+            if (!rules.count(rule_name) && !refs_in_progress.count(rule_name)) {
+                refs_in_progress.insert(rule_name);
+                // Most definitions are added as rule_name itself, only the others need an alias
+                std::string body = visit(resolve_ref(ref), rule_name);
+                if (body != rule_name) {
+                    rules[rule_name] = body;
+                }
+                refs_in_progress.erase(rule_name);
+            }
+            return rule_name;
+        }
+        if (schema.contains("const")) {
+            primitive("space");
+            return add_rule(name, value_literal(schema["const"]));
+        }
+        if (schema.contains("enum")) {
+            std::string body;
+            for (const auto& value : schema["enum"]) {
+                body += (body.empty() ? "" : " | ") + value_literal(value);
+            }
+            primitive("space");
+            return add_rule(name, body);
+        }
+        if (schema.contains("anyOf") || schema.contains("oneOf")) {
+            return add_rule(name, visit_alternatives(schema.contains("anyOf") ? schema["anyOf"] : schema["oneOf"], name));
+        }
+
+        json type = schema.value("type", json());
+        if (type.is_array()) {
+            json alternatives = json::array();
+            for (const auto& t : type) {
+                json sub = schema;
+                sub["type"] = t;
+                alternatives.push_back(sub);
+            }
+            return add_rule(name, visit_alternatives(alternatives, name));
+        }
+
+        std::string t = type.is_string() ? type.get<std::string>() : (schema.contains("properties") ? "object" : "");
+        if (t == "object") {
+            return add_rule(name, visit_object(schema, name));
+        }
+        if (t == "array") {
+            return add_rule(name, visit_array(schema, name));
+        }
+        if (t == "string") {
+            return add_rule(name, visit_string(schema));
+        }
+        if (t == "number" || t == "integer" || t == "boolean" || t == "null") {
+            return primitive(t);
+        }
+        if (t.empty()) {
+            return primitive("value");
+        }
+        throw std::invalid_argument("unsupported schema type: " + t);
+    }
+};
+
+std::string schema_to_gbnf(const json& schema) {
+    return SchemaConverter(schema).convert();
+}
+
+json tools_to_schema(const json& tools) {
+    if (!tools.is_array() || tools.empty()) {
+        throw std::invalid_argument("'tools' must be a non-empty array");
+    }
+
+    json alternatives = json::array();
+    for (const auto& tool : tools) {
+        const json& function = tool.contains("function") ? tool["function"] : tool;
+        std::string name = function.at("name").get<std::string>();
+
+        json parameters = json::object({{"type", "object"}});
+        if (function.contains("parameters")) {
+            parameters = function["parameters"];
+        } else if (function.contains("inputSchema")) {
+            parameters = function["inputSchema"];
+        }
+
+        alternatives.push_back({
+            {"type", "object"},
+            {"properties", {
+                {"tool_name", {{"const", name}}},
+                {"parameters", parameters},
+            }},
+            {"required", {"tool_name", "parameters"}},
+        });
+    }
+    return {{"anyOf", alternatives}};
+}
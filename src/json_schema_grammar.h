@@ -0,0 +1,20 @@
+#ifndef JSON_SCHEMA_GRAMMAR_H
+#define JSON_SCHEMA_GRAMMAR_H
+
+#include <string>
+#include <nlohmann/json.hpp>
+
+// Converts a JSON schema into a GBNF grammar (root rule "root") for llama_sampler_init_grammar.
+// Supported: type (incl. type lists), properties/required, items/minItems/maxItems, enum, const,
+// anyOf/oneOf, minLength/maxLength and local $ref. Objects with properties only accept the
+// declared ones, which keeps the generated JSON minimal. Throws std::invalid_argument for
+// schemas it cannot express.
+std::string schema_to_gbnf(const nlohmann::json& schema);
+
+// Builds the schema of a tool call in the form the agents parse:
+//   {"tool_name": "<name>", "parameters": {...}}
+// Accepts OpenAI tools ({"type":"function","function":{...}}), MCP tools ({"name","inputSchema"})
+// and plain {"name","parameters"} entries.
+nlohmann::json tools_to_schema(const nlohmann::json& tools);
+
+#endif // JSON_SCHEMA_GRAMMAR_H
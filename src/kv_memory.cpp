@@ -0,0 +1,89 @@
+#include "kv_memory.h"
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+
+using json = nlohmann::json;
+
+static int meta_int(const llama_model* model, const std::string& key, int fallback) {
+    char buf[128];
+    if (llama_model_meta_val_str(model, key.c_str(), buf, sizeof(buf)) < 0) {
+        return fallback;
+    }
+    return atoi(buf);
+}
+
+uint64_t KVMemory::model_bytes_per_token(const llama_model* model, ggml_type type_k, ggml_type type_v) {
+    char arch[64] = "";
+    llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+
+    // Head sizes may differ from n_embd / n_head (e.g. Gemma), the GGUF says so when they do
+    const int n_head = std::max(1, (int) llama_model_n_head(model));
+    const int head_k = meta_int(model, std::string(arch) + ".attention.key_length", llama_model_n_embd(model) / n_head);
+    const int head_v = meta_int(model, std::string(arch) + ".attention.value_length", head_k);
+    const int64_t n_head_kv = llama_model_n_head_kv(model);
+
+    return (uint64_t) llama_model_n_layer(model) *
+           (ggml_row_size(type_k, n_head_kv * head_k) + ggml_row_size(type_v, n_head_kv * head_v));
+}
+
+KVMemory KVMemory::compute(const llama_model* model, const llama_model* draft_model, const LLMConfig& config, uint64_t budget_bytes) {
+    KVMemory kv;
+    kv.type_k = config.type_k;
+    kv.type_v = config.type_v;
+    kv.flash_attn = config.flash_attn;
+    kv.n_ctx = config.n_ctx;
+    kv.n_sessions = config.n_parallel;
+    kv.budget_bytes = budget_bytes;
+
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    LLMConfig::parse_kv_type(config.type_k, type_k);
+    LLMConfig::parse_kv_type(config.type_v, type_v);
+    kv.bytes_per_token = model_bytes_per_token(model, type_k, type_v);
+    if (draft_model) {
+        kv.bytes_per_token += model_bytes_per_token(draft_model, type_k, type_v);
+    }
+    kv.bytes_per_session = kv.bytes_per_token * config.n_ctx;
+    kv.allocated_bytes = kv.bytes_per_session * config.n_parallel;
+    kv.max_sessions = kv.bytes_per_session > 0 ? (int) (budget_bytes / kv.bytes_per_session) : 0;
+    return kv;
+}
+
+uint64_t KVMemory::available_bytes() {
+    std::ifstream in("/proc/meminfo");
+    std::string key;
+    uint64_t value = 0;
+    std::string unit;
+    while (in >> key >> value >> unit) {
+        if (key == "MemAvailable:") {
+            return value * 1024;
+        }
+    }
+    return 0;
+}
+
+json KVMemory::to_json() const {
+    return {
+        {"type_k", type_k},
+        {"type_v", type_v},
+        {"flash_attn", flash_attn},
+        {"n_ctx", n_ctx},
+        {"bytes_per_token", bytes_per_token},
+        {"bytes_per_session", bytes_per_session},
+        {"allocated_bytes", allocated_bytes},
+        {"budget_bytes", budget_bytes},
+        {"n_sessions", n_sessions},
+        {"max_sessions", max_sessions},
+    };
+}
+
+std::string KVMemory::summary() const {
+    const double MiB = 1024.0 * 1024.0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "KV %s/%s%s: %.1f KiB per token, %.1f MiB per %d token session, %d sessions use %.1f MiB, "
+             "%d fit in %.1f MiB", type_k.c_str(), type_v.c_str(), flash_attn ? " flash_attn" : "", bytes_per_token / 1024.0,
+             bytes_per_session / MiB, n_ctx, n_sessions, allocated_bytes / MiB, max_sessions, budget_bytes / MiB);
+    return buf;
+}
@@ -0,0 +1,36 @@
+#ifndef KV_MEMORY_H
+#define KV_MEMORY_H
+
+#include <string>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include "llama.h"
+#include "llm_config.h"
+
+// KV cache memory of one model instance, computed from the shape of the model and the configured
+// cache types. Sliding window layers are counted at full length, so it is an upper bound for them.
+struct KVMemory {
+    std::string type_k;
+    std::string type_v;
+    bool flash_attn = false;
+    int n_ctx = 0;                  // tokens of one session
+    uint64_t bytes_per_token = 0;   // K and V of every layer, the draft model's included
+    uint64_t bytes_per_session = 0;
+    uint64_t allocated_bytes = 0;   // cache of all configured sessions
+    uint64_t budget_bytes = 0;
+    int n_sessions = 0;             // configured sessions (n_parallel)
+    int max_sessions = 0;           // sessions of n_ctx tokens that fit the budget
+
+    // budget_bytes is what may be spent on KV, usually available_bytes() before the cache exists
+    static KVMemory compute(const llama_model* model, const llama_model* draft_model, const LLMConfig& config, uint64_t budget_bytes);
+    // MemAvailable of the host, 0 if unknown
+    static uint64_t available_bytes();
+
+    nlohmann::json to_json() const;
+    std::string summary() const;
+
+private:
+    static uint64_t model_bytes_per_token(const llama_model* model, ggml_type type_k, ggml_type type_v);
+};
+
+#endif // KV_MEMORY_H
@@ -0,0 +1,339 @@
+#include "kv_snapshot_store.h"
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+namespace fs = std::filesystem;
+
+static const char     SNAPSHOT_MAGIC[4] = {'K', 'V', 'S', 'N'};
+static const uint32_t SNAPSHOT_VERSION  = 3;
+static const size_t   MAX_PREFETCHED    = 16;           // snapshots read ahead and not loaded yet
+static const uint64_t STATE_OVERHEAD    = 16ULL << 20;  // state bytes not proportional to the tokens
+
+KVSnapshotStore::KVSnapshotStore() : max_bytes(0), max_tokens(0), state_per_token(0), running(false) {}
+
+KVSnapshotStore::~KVSnapshotStore() {
+    close();
+}
+
+bool KVSnapshotStore::open(const std::string& dir, uint64_t max_bytes, std::function<void()> on_read) {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        LOGe("kv snapshots: cannot create %s: %s", dir.c_str(), ec.message().c_str());
+        return false;
+    }
+    this->dir = dir;
+    this->max_bytes = max_bytes;
+    this->on_read = std::move(on_read);
+    running = true;
+    writer = std::thread(&KVSnapshotStore::writer_loop, this);
+    LOGi("kv snapshots: %s, budget %llu MiB", dir.c_str(), (unsigned long long) (max_bytes >> 20));
+    return true;
+}
+
+void KVSnapshotStore::close() {
+    if (!writer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        running = false;
+    }
+    cv.notify_all();
+    writer.join();
+}
+
+void KVSnapshotStore::set_limits(uint32_t max_tokens, uint64_t state_per_token) {
+    this->max_tokens = max_tokens;
+    this->state_per_token = state_per_token;
+}
+
+void KVSnapshotStore::save(std::shared_ptr<const Snapshot> snapshot) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!running) {
+            return;
+        }
+        prefetched.erase(snapshot->conversation_id);
+        pending[snapshot->conversation_id] = std::move(snapshot);
+    }
+    cv.notify_one();
+}
+
+bool KVSnapshotStore::prefetch(const std::string& conversation_id) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!running || pending.count(conversation_id) || prefetched.count(conversation_id)) {
+            return true;
+        }
+        if (!reads.insert(conversation_id).second) {
+            return false;
+        }
+    }
+    cv.notify_one();
+    return false;
+}
+
+std::shared_ptr<const KVSnapshotStore::Snapshot> KVSnapshotStore::load(const std::string& conversation_id) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = pending.find(conversation_id);
+        if (it != pending.end()) {
+            return it->second;
+        }
+        auto found = prefetched.find(conversation_id);
+        if (found != prefetched.end()) {
+            auto snapshot = std::move(found->second);
+            prefetched.erase(found);
+            return snapshot;
+        }
+    }
+    return read_snapshot(conversation_id);
+}
+
+std::shared_ptr<const KVSnapshotStore::Snapshot> KVSnapshotStore::read_snapshot(const std::string& conversation_id) {
+    const std::string path = path_of(conversation_id);
+    auto snapshot = std::make_shared<Snapshot>();
+    if (!fs::exists(path) || !read_file(path, *snapshot)) {
+        return nullptr;
+    }
+    // Different IDs can share a file name, the stored ID decides
+    if (snapshot->conversation_id != conversation_id) {
+        return nullptr;
+    }
+
+    std::error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    return snapshot;
+}
+
+std::string KVSnapshotStore::path_of(const std::string& conversation_id) const {
+    // FNV-1a keeps arbitrary IDs out of the file system
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : conversation_id) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.kvs", (unsigned long long) hash);
+    return (fs::path(dir) / name).string();
+}
+
+void KVSnapshotStore::writer_loop() {
+    while (true) {
+        std::shared_ptr<const Snapshot> snapshot;
+        std::string read_id;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this] { return !running || !pending.empty() || !reads.empty(); });
+            if (!running && pending.empty()) {
+                break;
+            }
+            // A request is waiting for a read, writes can wait
+            if (!reads.empty()) {
+                read_id = *reads.begin();
+            } else {
+                snapshot = pending.begin()->second;
+            }
+        }
+
+        if (!read_id.empty()) {
+            auto loaded = read_snapshot(read_id);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                reads.erase(read_id);
+                // A turn saved meanwhile is newer than the file
+                if (!pending.count(read_id)) {
+                    // Prefetches whose request went away are not kept forever
+                    if (prefetched.size() >= MAX_PREFETCHED) {
+                        prefetched.erase(prefetched.begin());
+                    }
+                    prefetched[read_id] = std::move(loaded);
+                }
+            }
+            if (on_read) {
+                on_read();
+            }
+            continue;
+        }
+
+        const std::string path = path_of(snapshot->conversation_id);
+        const std::string tmp = path + ".tmp";
+        if (write_file(tmp, *snapshot)) {
+            std::error_code ec;
+            fs::rename(tmp, path, ec);
+            if (ec) {
+                LOGe("kv snapshots: rename %s failed: %s", tmp.c_str(), ec.message().c_str());
+            }
+        } else {
+            LOGe("kv snapshots: writing %s failed", tmp.c_str());
+            std::error_code ec;
+            fs::remove(tmp, ec);
+        }
+
+        {
+            // A newer snapshot may have been queued while this one was written
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = pending.find(snapshot->conversation_id);
+            if (it != pending.end() && it->second == snapshot) {
+                pending.erase(it);
+            }
+        }
+        enforce_budget();
+    }
+}
+
+void KVSnapshotStore::enforce_budget() {
+    struct Entry {
+        fs::file_time_type mtime;
+        uint64_t size;
+        fs::path path;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.path().extension() != ".kvs") {
+            continue;
+        }
+        uint64_t size = entry.file_size(ec);
+        entries.push_back({entry.last_write_time(ec), size, entry.path()});
+        total += size;
+    }
+
+    if (total <= max_bytes) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+    for (const auto& entry : entries) {
+        if (total <= max_bytes) {
+            break;
+        }
+        if (fs::remove(entry.path, ec)) {
+            total -= entry.size;
+            LOGi("kv snapshots: evicted %s", entry.path.filename().c_str());
+        }
+    }
+}
+
+template <typename T>
+static void write_pod(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void write_string(std::ofstream& out, const std::string& str) {
+    write_pod(out, (uint32_t) str.size());
+    out.write(str.data(), str.size());
+}
+
+// Every size read from a file is checked against the bytes left in it before anything is allocated
+class SnapshotReader {
+public:
+    SnapshotReader(const std::string& path, uint64_t size) : in(path, std::ios::binary), left(size) {}
+
+    template <typename T>
+    bool pod(T& value) {
+        return bytes(&value, sizeof(T));
+    }
+    bool bytes(void* data, uint64_t n) {
+        if (n > left) {
+            return false;
+        }
+        left -= n;
+        return (bool) in.read(reinterpret_cast<char*>(data), n);
+    }
+    bool string(std::string& str) {
+        uint32_t size;
+        if (!pod(size) || size > left) {
+            return false;
+        }
+        str.resize(size);
+        return bytes(&str[0], size);
+    }
+    template <typename T>
+    bool array(std::vector<T>& values, uint64_t n) {
+        if (n > left / sizeof(T)) {
+            return false;
+        }
+        values.resize(n);
+        return bytes(values.data(), n * sizeof(T));
+    }
+    uint64_t remaining() const { return left; }
+
+private:
+    std::ifstream in;
+    uint64_t left;
+};
+
+bool KVSnapshotStore::write_file(const std::string& path, const Snapshot& snapshot) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    write_pod(out, SNAPSHOT_VERSION);
+    write_string(out, snapshot.conversation_id);
+    write_string(out, snapshot.lora);
+    write_pod(out, (uint32_t) snapshot.messages.size());
+    for (const auto& msg : snapshot.messages) {
+        write_string(out, msg.first);
+        write_string(out, msg.second);
+    }
+    write_pod(out, (int32_t) snapshot.chat_history_len);
+    write_pod(out, (uint32_t) snapshot.message_pos.size());
+    out.write(reinterpret_cast<const char*>(snapshot.message_pos.data()), snapshot.message_pos.size() * sizeof(int32_t));
+    write_pod(out, (uint32_t) snapshot.tokens.size());
+    out.write(reinterpret_cast<const char*>(snapshot.tokens.data()), snapshot.tokens.size() * sizeof(llama_token));
+    write_pod(out, (uint64_t) snapshot.state.size());
+    out.write(reinterpret_cast<const char*>(snapshot.state.data()), snapshot.state.size());
+    return (bool) out;
+}
+
+bool KVSnapshotStore::read_file(const std::string& path, Snapshot& snapshot) const {
+    std::error_code ec;
+    const uint64_t file_size = fs::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    SnapshotReader in(path, file_size);
+    char magic[4];
+    uint32_t version;
+    if (!in.bytes(magic, sizeof(magic)) || !std::equal(magic, magic + 4, SNAPSHOT_MAGIC)
+        || !in.pod(version) || version != SNAPSHOT_VERSION) {
+        LOGe("kv snapshots: %s is not a snapshot file", path.c_str());
+        return false;
+    }
+
+    // A message is at least its two string lengths
+    uint32_t n_messages;
+    int32_t chat_history_len;
+    uint32_t n_message_pos;
+    uint32_t n_tokens;
+    uint64_t n_state;
+    bool ok = in.string(snapshot.conversation_id) && in.string(snapshot.lora) && in.pod(n_messages)
+              && n_messages <= in.remaining() / (2 * sizeof(uint32_t));
+    if (ok) {
+        snapshot.messages.resize(n_messages);
+        for (auto& msg : snapshot.messages) {
+            ok = ok && in.string(msg.first) && in.string(msg.second);
+        }
+    }
+    ok = ok && in.pod(chat_history_len) && chat_history_len >= 0
+         && in.pod(n_message_pos) && n_message_pos <= n_messages && in.array(snapshot.message_pos, n_message_pos)
+         && in.pod(n_tokens) && (max_tokens == 0 || n_tokens <= max_tokens) && in.array(snapshot.tokens, n_tokens)
+         // The state is the rest of the file, and no larger than the model's KV for the tokens
+         && in.pod(n_state) && n_state == in.remaining()
+         && (state_per_token == 0 || n_state <= n_tokens * state_per_token + STATE_OVERHEAD);
+    if (!ok) {
+        LOGe("kv snapshots: %s is truncated or corrupt", path.c_str());
+        return false;
+    }
+    snapshot.chat_history_len = chat_history_len;
+    return in.array(snapshot.state, n_state);
+}
@@ -0,0 +1,78 @@
+#ifndef KV_SNAPSHOT_STORE_H
+#define KV_SNAPSHOT_STORE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include "llama.h"
+
+// Conversation-ID keyed KV snapshots on disk. A snapshot holds everything needed to resume a
+// conversation without prefilling it again: the chat history, the tokens in the sequence and the
+// sequence state from llama_state_seq_get_data. Writes happen on a background thread, which also
+// reads the snapshots prefetched for conversations about to resume. The directory is kept under
+// max_bytes by deleting the least recently used snapshots.
+class KVSnapshotStore {
+public:
+    struct Snapshot {
+        std::string conversation_id;
+        std::string lora;                   // adapter the state was computed with, empty for the base model
+        std::vector<std::pair<std::string, std::string>> messages; // role, content
+        int chat_history_len = 0;
+        std::vector<int32_t> message_pos;   // token position where each message's content starts
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state;
+    };
+
+    KVSnapshotStore();
+    ~KVSnapshotStore();
+
+    // on_read is called on the background thread whenever a prefetched snapshot has been read
+    bool open(const std::string& dir, uint64_t max_bytes, std::function<void()> on_read = nullptr);
+    // Files with more tokens, or more state than state_per_token bytes per token plus a fixed
+    // allowance, are rejected as corrupt. 0 does not check. Set before open()
+    void set_limits(uint32_t max_tokens, uint64_t state_per_token);
+    // Flushes the pending writes
+    void close();
+    bool enabled() const { return running; }
+
+    // Queues the snapshot for writing, a newer snapshot of the same conversation replaces a pending one
+    void save(std::shared_ptr<const Snapshot> snapshot);
+    // Starts reading the conversation's snapshot on the background thread. True once load() can
+    // return it, or know there is none, without touching the disk
+    bool prefetch(const std::string& conversation_id);
+    // Returns the latest snapshot of the conversation, nullptr if there is none. Reads the file on
+    // the calling thread if it was not prefetched
+    std::shared_ptr<const Snapshot> load(const std::string& conversation_id);
+
+private:
+    std::string dir;
+    uint64_t max_bytes;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<std::string, std::shared_ptr<const Snapshot>> pending;
+    std::set<std::string> reads;        // prefetches not read yet
+    std::map<std::string, std::shared_ptr<const Snapshot>> prefetched;  // nullptr if there is no snapshot
+    std::function<void()> on_read;
+    uint32_t max_tokens;
+    uint64_t state_per_token;
+    std::thread writer;
+    bool running;
+
+    std::string path_of(const std::string& conversation_id) const;
+    void writer_loop();
+    void enforce_budget();
+    std::shared_ptr<const Snapshot> read_snapshot(const std::string& conversation_id);
+
+    static bool write_file(const std::string& path, const Snapshot& snapshot);
+    bool read_file(const std::string& path, Snapshot& snapshot) const;
+};
+
+#endif // KV_SNAPSHOT_STORE_H
@@ -0,0 +1,216 @@
+#include "llm_autotune.h"
+#include <vector>
+#include <set>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+static const int N_PROMPT = 1024;   // prefill benchmark: one sequence of this many tokens
+static const int N_PREFIX = 32;     // decode benchmark: context of every sequence before timing
+static const int N_GEN    = 32;     // decode benchmark: timed steps
+
+class Bench {
+public:
+    explicit Bench(llama_model* model) : model(model) {
+        const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<llama_token> dist(0, n_vocab - 1);
+        tokens.resize(N_PROMPT + N_PREFIX + N_GEN);
+        for (auto& token : tokens) {
+            token = dist(rng);
+        }
+    }
+
+    // Prefill tokens per second, 0 if the configuration does not work
+    double prefill(const LLMConfig& config) {
+        llama_context* ctx = llama_init_from_model(model, config.context_params(N_PROMPT + 16, 1));
+        if (!ctx) {
+            return 0.0;
+        }
+        llama_batch batch = llama_batch_init(config.n_batch, 0, 1);
+
+        double result = 0.0;
+        if (decode(ctx, batch, 0, 0, 16)) {
+            llama_memory_clear(llama_get_memory(ctx), true);
+            auto t0 = std::chrono::steady_clock::now();
+            bool ok = true;
+            for (int i = 0; ok && i < N_PROMPT; i += config.n_batch) {
+                ok = decode(ctx, batch, 0, i, std::min(config.n_batch, N_PROMPT - i));
+            }
+            if (ok) {
+                result = N_PROMPT / seconds_since(t0);
+            }
+        }
+
+        llama_batch_free(batch);
+        llama_free(ctx);
+        return result;
+    }
+
+    // Decode tokens per second over all n_parallel sequences, 0 if the configuration does not work
+    double decode(const LLMConfig& config) {
+        const int n_seq = config.n_parallel;
+        llama_context* ctx = llama_init_from_model(model, config.context_params(n_seq * (N_PREFIX + N_GEN + 8), n_seq));
+        if (!ctx) {
+            return 0.0;
+        }
+        // A step of n_seq tokens would run on n_threads_batch, the server runs decode steps of
+        // several slots on the n_threads pool
+        llama_set_n_threads(ctx, config.threads(), config.threads());
+        llama_batch batch = llama_batch_init(std::max(n_seq, N_PREFIX), 0, 1);
+
+        bool ok = true;
+        for (int s = 0; ok && s < n_seq; s++) {
+            ok = decode(ctx, batch, s, 0, N_PREFIX);
+        }
+        double result = 0.0;
+        if (ok) {
+            auto t0 = std::chrono::steady_clock::now();
+            for (int step = 0; ok && step < N_GEN; step++) {
+                batch.n_tokens = 0;
+                for (int s = 0; s < n_seq; s++) {
+                    add(batch, tokens[N_PROMPT + N_PREFIX + step], N_PREFIX + step, s, true);
+                }
+                ok = llama_decode(ctx, batch) == 0;
+            }
+            llama_synchronize(ctx);
+            if (ok) {
+                result = n_seq * N_GEN / seconds_since(t0);
+            }
+        }
+
+        llama_batch_free(batch);
+        llama_free(ctx);
+        return result;
+    }
+
+private:
+    llama_model* model;
+    std::vector<llama_token> tokens;
+
+    static void add(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+        const int i = batch.n_tokens++;
+        batch.token[i] = token;
+        batch.pos[i] = pos;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = seq;
+        batch.logits[i] = logits;
+    }
+
+    bool decode(llama_context* ctx, llama_batch& batch, llama_seq_id seq, int first, int n) {
+        batch.n_tokens = 0;
+        for (int i = 0; i < n; i++) {
+            add(batch, tokens[(first + i) % N_PROMPT], first + i, seq, i == n - 1);
+        }
+        bool ok = llama_decode(ctx, batch) == 0;
+        llama_synchronize(ctx);
+        return ok;
+    }
+
+    static double seconds_since(std::chrono::steady_clock::time_point t0) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+};
+
+static std::vector<int> thread_candidates() {
+    const int n_cpus = std::max(1, (int) std::thread::hardware_concurrency());
+    std::set<int> candidates = {n_cpus, std::max(1, n_cpus / 2), std::max(1, n_cpus * 3 / 4)};
+    for (int n = 1; n < n_cpus; n *= 2) {
+        // Far below the core count only matters on small hosts
+        if (n >= n_cpus / 8) {
+            candidates.insert(n);
+        }
+    }
+    return std::vector<int>(candidates.begin(), candidates.end());
+}
+
+bool llm_autotune(const LLMConfig& base, const std::string& out_path) {
+    std::string error;
+    if (!base.validate(error)) {
+        LOGe("autotune: %s", error.c_str());
+        return false;
+    }
+
+    llama_backend_init();
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = base.gpu_layers;
+    llama_model* model = llama_model_load_from_file(base.model_path.c_str(), model_params);
+    if (!model) {
+        LOGe("autotune: cannot load %s", base.model_path.c_str());
+        llama_backend_free();
+        return false;
+    }
+
+    Bench bench(model);
+    LLMConfig best = base;
+    best.n_threads = base.threads();
+    best.n_threads_batch = base.threads_batch();
+    const std::vector<int> threads = thread_candidates();
+
+    // Coordinate descent, one parameter at a time with the best values found so far
+    double best_prefill = 0.0;
+    for (int n : threads) {
+        LLMConfig config = best;
+        config.n_threads_batch = n;
+        double tps = bench.prefill(config);
+        LOGi("autotune: prefill n_threads_batch = %3d: %8.1f tokens/s", n, tps);
+        if (tps > best_prefill) {
+            best_prefill = tps;
+            best.n_threads_batch = n;
+        }
+    }
+    for (int n : {128, 256, 512, 1024, 2048}) {
+        // Every decode step takes a token of each slot
+        if (n < best.n_parallel) {
+            continue;
+        }
+        LLMConfig config = best;
+        config.n_batch = config.n_ubatch = n;
+        double tps = bench.prefill(config);
+        LOGi("autotune: prefill n_batch = n_ubatch = %4d: %8.1f tokens/s", n, tps);
+        if (tps > best_prefill) {
+            best_prefill = tps;
+            best.n_batch = best.n_ubatch = n;
+        }
+    }
+
+    double best_decode = 0.0;
+    for (int n : threads) {
+        LLMConfig config = best;
+        config.n_threads = n;
+        double tps = bench.decode(config);
+        LOGi("autotune: decode %d sequences, n_threads = %3d: %8.1f tokens/s", config.n_parallel, n, tps);
+        if (tps > best_decode) {
+            best_decode = tps;
+            best.n_threads = n;
+        }
+    }
+
+    // Flash attention affects both phases, it is kept if it helps them on balance
+    LLMConfig other = best;
+    other.flash_attn = !best.flash_attn;
+    std::string other_error;
+    if (other.validate(other_error)) {
+        double prefill = bench.prefill(other);
+        double decode = bench.decode(other);
+        LOGi("autotune: flash_attn = %d: prefill %8.1f, decode %8.1f tokens/s", other.flash_attn, prefill, decode);
+        if (best_prefill > 0.0 && best_decode > 0.0 && prefill / best_prefill + decode / best_decode > 2.0) {
+            best = other;
+            best_prefill = prefill;
+            best_decode = decode;
+        }
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    LOGi("autotune: best n_threads = %d, n_threads_batch = %d, n_batch = %d, n_ubatch = %d, flash_attn = %d",
+         best.n_threads, best.n_threads_batch, best.n_batch, best.n_ubatch, best.flash_attn);
+    LOGi("autotune: prefill %.1f tokens/s, decode %.1f tokens/s", best_prefill, best_decode);
+    return best.save_file(out_path);
+}
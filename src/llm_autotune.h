@@ -0,0 +1,14 @@
+#ifndef LLM_AUTOTUNE_H
+#define LLM_AUTOTUNE_H
+
+#include <string>
+#include "llm_config.h"
+
+// Measures prefill and decode throughput of the configured model on this host while sweeping
+// threads, batch sizes and flash attention, then writes base with the fastest values to
+// out_path. Prefill settings (n_threads_batch, n_batch/n_ubatch) are chosen by prefill tokens/s,
+// decode settings (n_threads) by the tokens/s of n_parallel sequences decoding together.
+// KV cache types are kept as configured, they trade quality for memory rather than speed.
+bool llm_autotune(const LLMConfig& base, const std::string& out_path);
+
+#endif // LLM_AUTOTUNE_H
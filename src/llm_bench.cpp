@@ -0,0 +1,220 @@
+#include "llm_bench.h"
+#include "detokenizer.h"
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+static const int N_ROUNDS = 5;  // each path runs this many times over the tokens, the fastest counts
+
+// One request's answer. Byte-level vocabularies split the CJK characters and the emoji over
+// several tokens, which is what the UTF-8 holdback is for
+static const char* SAMPLE =
+    "Sure! Here is a short summary of the changes, followed by an example.\n\n"
+    "1. The scheduler now batches prompt chunks with decode steps, so streaming stays smooth.\n"
+    "2. 缓存命中时直接复用前缀的KV，不再重新计算；未命中的部分按批次预填充。\n"
+    "3. Stop strings are matched on the text, not on tokens 🙂, and never reach the client.\n\n"
+    "```cpp\nfor (auto& slot : slots) {\n    if (slot.state == SLOT_DECODE) {\n        n_active++;\n    }\n}\n```\n\n"
+    "Résumé : la latence par token baisse d'environ 3 % — 日本語のテキストも同様です。✅";
+
+using Callback = std::function<bool(std::string_view piece)>;
+
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// The previous path: a new string per token, as common_token_to_piece returns it
+static std::string token_to_piece(const llama_vocab* vocab, llama_token token) {
+    std::string piece;
+    piece.resize(piece.capacity());
+    const int n = llama_token_to_piece(vocab, token, &piece[0], piece.size(), 0, true);
+    if (n < 0) {
+        piece.resize(-n);
+        llama_token_to_piece(vocab, token, &piece[0], piece.size(), 0, true);
+    } else {
+        piece.resize(n);
+    }
+    return piece;
+}
+
+// The previous path: the pending bytes scanned from the start after every token
+static bool is_valid_utf8(const char* string) {
+    const unsigned char* bytes = (const unsigned char*) string;
+    while (*bytes != 0x00) {
+        int num;
+        if ((*bytes & 0x80) == 0x00) {
+            num = 1;
+        } else if ((*bytes & 0xE0) == 0xC0) {
+            num = 2;
+        } else if ((*bytes & 0xF0) == 0xE0) {
+            num = 3;
+        } else if ((*bytes & 0xF8) == 0xF0) {
+            num = 4;
+        } else {
+            return false;
+        }
+        bytes += 1;
+        for (int i = 1; i < num; ++i) {
+            if ((*bytes & 0xC0) != 0x80) {
+                return false;
+            }
+            bytes += 1;
+        }
+    }
+    return true;
+}
+
+class Bench {
+public:
+    Bench(const llama_vocab* vocab, const std::vector<llama_token>& tokens, int n_request)
+        : vocab(vocab), tokens(tokens), n_request(n_request) {}
+
+    // Seconds for all tokens through the previous per-token path
+    double before(const Callback& on_token) {
+        std::function<bool(const std::string&)> consumer = [&on_token](const std::string& piece) {
+            return on_token(piece);
+        };
+        std::string pending;
+        std::string generated;
+        size_t n_sent = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (i % n_request == 0) {
+                pending.clear();
+                generated.clear();
+                n_sent = 0;
+            }
+            pending += token_to_piece(vocab, tokens[i]);
+            if (is_valid_utf8(pending.c_str())) {
+                generated += pending;
+                pending.clear();
+                if (generated.size() > n_sent) {
+                    consumer(generated.substr(n_sent));
+                    n_sent = generated.size();
+                }
+            }
+        }
+        return seconds_since(t0);
+    }
+
+    // Seconds for all tokens through the path of LLM::process_token
+    double after(const PieceCache& pieces, const Callback& on_token) {
+        Utf8Stream utf8;
+        std::string pending;
+        std::string generated;
+        generated.reserve(n_request * 4);
+        size_t n_sent = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (i % n_request == 0) {
+                utf8.reset();
+                pending.clear();
+                generated.clear();
+                n_sent = 0;
+            }
+            const std::string_view piece = pieces.get(tokens[i]);
+            std::string_view text;
+            const bool ready = utf8.feed(piece);
+            if (ready && pending.empty()) {
+                text = piece;
+            } else {
+                pending.append(piece.data(), piece.size());
+                text = pending;
+            }
+            if (ready) {
+                generated.append(text.data(), text.size());
+                pending.clear();
+                if (generated.size() > n_sent) {
+                    on_token(std::string_view(generated).substr(n_sent));
+                    n_sent = generated.size();
+                }
+            }
+        }
+        return seconds_since(t0);
+    }
+
+private:
+    const llama_vocab* vocab;
+    const std::vector<llama_token>& tokens;
+    const int n_request;
+};
+
+bool llm_bench(const LLMConfig& config, int n_tokens) {
+    if (config.model_path.empty() || n_tokens <= 0) {
+        LOGe("bench: needs a model and --bench <n_tokens> > 0");
+        return false;
+    }
+
+    llama_backend_init();
+    llama_model_params model_params = llama_model_default_params();
+    model_params.vocab_only = true;
+    llama_model* model = llama_model_load_from_file(config.model_path.c_str(), model_params);
+    if (!model) {
+        LOGe("bench: cannot load %s", config.model_path.c_str());
+        llama_backend_free();
+        return false;
+    }
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+
+    // The sample tokenized once is one request, repeated until there are n_tokens
+    const std::string sample = SAMPLE;
+    std::vector<llama_token> request(sample.size() + 16);
+    const int n_request = llama_tokenize(vocab, sample.c_str(), sample.size(), request.data(), request.size(), false, false);
+    if (n_request <= 0) {
+        LOGe("bench: cannot tokenize the sample text");
+        llama_model_free(model);
+        llama_backend_free();
+        return false;
+    }
+    request.resize(n_request);
+    std::vector<llama_token> tokens;
+    tokens.reserve(n_tokens + n_request);
+    while ((int) tokens.size() < n_tokens) {
+        tokens.insert(tokens.end(), request.begin(), request.end());
+    }
+    tokens.resize(n_tokens);
+
+    auto t0 = std::chrono::steady_clock::now();
+    PieceCache pieces;
+    pieces.build(vocab);
+    LOGi("bench: piece cache of %d tokens, %zu bytes, built in %.1f ms",
+         llama_vocab_n_tokens(vocab), pieces.n_bytes(), seconds_since(t0) * 1e3);
+
+    // Both paths must hand the consumer the same text
+    std::string text_before;
+    std::string text_after;
+    Bench bench(vocab, tokens, n_request);
+    bench.before([&text_before](std::string_view piece) { text_before.append(piece.data(), piece.size()); return true; });
+    bench.after(pieces, [&text_after](std::string_view piece) { text_after.append(piece.data(), piece.size()); return true; });
+    if (text_before != text_after) {
+        LOGe("bench: the two paths disagree (%zu vs %zu bytes)", text_before.size(), text_after.size());
+        llama_model_free(model);
+        llama_backend_free();
+        return false;
+    }
+
+    // The consumer only counts, so the time is the loop's own
+    size_t n_bytes = 0;
+    Callback count = [&n_bytes](std::string_view piece) { n_bytes += piece.size(); return true; };
+    double best_before = 1e30;
+    double best_after = 1e30;
+    for (int round = 0; round < N_ROUNDS; round++) {
+        best_before = std::min(best_before, bench.before(count));
+        best_after = std::min(best_after, bench.after(pieces, count));
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    const double ns_before = best_before * 1e9 / n_tokens;
+    const double ns_after = best_after * 1e9 / n_tokens;
+    LOGi("bench: %d tokens in requests of %d, %.2f bytes/token", n_tokens, n_request, (double) text_after.size() / n_tokens);
+    LOGi("bench: before: %8.1f ns/token (a string per piece, UTF-8 rescan, a copy per callback)", ns_before);
+    LOGi("bench: after:  %8.1f ns/token (piece cache, streaming UTF-8, reserved output)", ns_after);
+    LOGi("bench: %.2fx less host time per token", ns_before / ns_after);
+    return true;
+}
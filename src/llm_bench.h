@@ -0,0 +1,15 @@
+#ifndef LLM_BENCH_H
+#define LLM_BENCH_H
+
+#include <string>
+#include "llm_config.h"
+
+// Measures the host work the decode loop does per generated token between llama_decode calls:
+// turning the token into text, holding back incomplete UTF-8 and handing the piece to the
+// consumer. Runs n_tokens of mixed-script text through the previous per-token path (a string per
+// piece, a rescan of the pending bytes, a copy per callback) and through the piece cache and
+// streaming UTF-8 check process_token uses now, and prints ns/token for both. Only the vocabulary
+// of the configured model is loaded.
+bool llm_bench(const LLMConfig& config, int n_tokens);
+
+#endif // LLM_BENCH_H
@@ -0,0 +1,293 @@
+#include "llm_config.h"
+#include <fstream>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+using json = nlohmann::json;
+
+static const std::pair<const char*, ggml_type> KV_TYPES[] = {
+    {"f32",    GGML_TYPE_F32},
+    {"f16",    GGML_TYPE_F16},
+    {"bf16",   GGML_TYPE_BF16},
+    {"q8_0",   GGML_TYPE_Q8_0},
+    {"q5_1",   GGML_TYPE_Q5_1},
+    {"q5_0",   GGML_TYPE_Q5_0},
+    {"q4_1",   GGML_TYPE_Q4_1},
+    {"q4_0",   GGML_TYPE_Q4_0},
+    {"iq4_nl", GGML_TYPE_IQ4_NL},
+};
+
+bool LLMConfig::parse_kv_type(const std::string& name, ggml_type& type) {
+    for (const auto& entry : KV_TYPES) {
+        if (name == entry.first) {
+            type = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LLMConfig::parse_numa(const std::string& name, ggml_numa_strategy& strategy) {
+    static const std::pair<const char*, ggml_numa_strategy> STRATEGIES[] = {
+        {"disabled",   GGML_NUMA_STRATEGY_DISABLED},
+        {"distribute", GGML_NUMA_STRATEGY_DISTRIBUTE},
+        {"isolate",    GGML_NUMA_STRATEGY_ISOLATE},
+        {"numactl",    GGML_NUMA_STRATEGY_NUMACTL},
+    };
+    for (const auto& entry : STRATEGIES) {
+        if (name == entry.first) {
+            strategy = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LLMConfig::parse_pooling(const std::string& name, enum llama_pooling_type& pooling) {
+    static const std::pair<const char*, enum llama_pooling_type> POOLINGS[] = {
+        {"",     LLAMA_POOLING_TYPE_UNSPECIFIED},
+        {"mean", LLAMA_POOLING_TYPE_MEAN},
+        {"cls",  LLAMA_POOLING_TYPE_CLS},
+        {"last", LLAMA_POOLING_TYPE_LAST},
+    };
+    for (const auto& entry : POOLINGS) {
+        if (name == entry.first) {
+            pooling = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LLMConfig::load_file(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        LOGe("config: cannot open %s", path.c_str());
+        return false;
+    }
+    try {
+        return from_json(json::parse(in));
+    } catch (const std::exception& e) {
+        LOGe("config: %s: %s", path.c_str(), e.what());
+        return false;
+    }
+}
+
+bool LLMConfig::save_file(const std::string& path) const {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        LOGe("config: cannot write %s", path.c_str());
+        return false;
+    }
+    out << to_json().dump(4) << std::endl;
+    return (bool) out;
+}
+
+json LLMConfig::to_json() const {
+    return {
+        {"model_path", model_path},
+        {"models", models},
+        {"mmproj_path", mmproj_path},
+        {"vision_cache_bytes", vision_cache_bytes},
+        {"draft_model_path", draft_model_path},
+        {"lora", lora},
+        {"gpu_layers", gpu_layers},
+        {"use_mmap", use_mmap},
+        {"n_parallel", n_parallel},
+        {"n_ctx", n_ctx},
+        {"n_batch", n_batch},
+        {"n_ubatch", n_ubatch},
+        {"n_threads", n_threads},
+        {"n_threads_batch", n_threads_batch},
+        {"cpu_mask", cpu_mask},
+        {"cpu_mask_batch", cpu_mask_batch},
+        {"cpu_strict", cpu_strict},
+        {"poll", poll},
+        {"type_k", type_k},
+        {"type_v", type_v},
+        {"flash_attn", flash_attn},
+        {"kv_budget", kv_budget},
+        {"context_shift", context_shift},
+        {"embedding", embedding},
+        {"pooling", pooling},
+        {"numa", numa},
+        {"snapshot_dir", snapshot_dir},
+        {"snapshot_bytes", snapshot_bytes},
+        {"port", port},
+        {"request_timeout", request_timeout},
+        {"conversation_ttl", conversation_ttl},
+        {"max_conversations", max_conversations},
+    };
+}
+
+bool LLMConfig::from_json(const json& j) {
+    if (!j.is_object()) {
+        LOGe("config: expected a JSON object");
+        return false;
+    }
+    // Unknown keys are reported so a typo does not silently fall back to the default
+    json known = to_json();
+    for (const auto& item : j.items()) {
+        if (!known.contains(item.key())) {
+            LOGe("config: unknown key '%s'", item.key().c_str());
+            return false;
+        }
+    }
+    model_path       = j.value("model_path", model_path);
+    models           = j.value("models", models);
+    mmproj_path      = j.value("mmproj_path", mmproj_path);
+    vision_cache_bytes = j.value("vision_cache_bytes", vision_cache_bytes);
+    draft_model_path = j.value("draft_model_path", draft_model_path);
+    lora             = j.value("lora", lora);
+    gpu_layers       = j.value("gpu_layers", gpu_layers);
+    use_mmap         = j.value("use_mmap", use_mmap);
+    n_parallel       = j.value("n_parallel", n_parallel);
+    n_ctx            = j.value("n_ctx", n_ctx);
+    n_batch          = j.value("n_batch", n_batch);
+    n_ubatch         = j.value("n_ubatch", n_ubatch);
+    n_threads        = j.value("n_threads", n_threads);
+    n_threads_batch  = j.value("n_threads_batch", n_threads_batch);
+    cpu_mask         = j.value("cpu_mask", cpu_mask);
+    cpu_mask_batch   = j.value("cpu_mask_batch", cpu_mask_batch);
+    cpu_strict       = j.value("cpu_strict", cpu_strict);
+    poll             = j.value("poll", poll);
+    type_k           = j.value("type_k", type_k);
+    type_v           = j.value("type_v", type_v);
+    flash_attn       = j.value("flash_attn", flash_attn);
+    kv_budget        = j.value("kv_budget", kv_budget);
+    context_shift    = j.value("context_shift", context_shift);
+    embedding        = j.value("embedding", embedding);
+    pooling          = j.value("pooling", pooling);
+    numa             = j.value("numa", numa);
+    snapshot_dir     = j.value("snapshot_dir", snapshot_dir);
+    snapshot_bytes   = j.value("snapshot_bytes", snapshot_bytes);
+    port             = j.value("port", port);
+    request_timeout  = j.value("request_timeout", request_timeout);
+    conversation_ttl = j.value("conversation_ttl", conversation_ttl);
+    max_conversations = j.value("max_conversations", max_conversations);
+    return true;
+}
+
+bool LLMConfig::parse_args(int argc, char** argv, std::vector<std::string>& positional, std::map<std::string, std::string>& extra) {
+    std::vector<std::pair<std::string, std::string>> flags;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        std::string key = arg.substr(2);
+        std::replace(key.begin(), key.end(), '-', '_');
+        std::string value;
+        size_t eq = key.find('=');
+        if (eq != std::string::npos) {
+            value = key.substr(eq + 1);
+            key = key.substr(0, eq);
+        } else if (i + 1 < argc) {
+            value = argv[++i];
+        } else {
+            LOGe("config: --%s needs a value", key.c_str());
+            return false;
+        }
+        flags.emplace_back(key, value);
+    }
+
+    for (const auto& flag : flags) {
+        if (flag.first == "config" && !load_file(flag.second)) {
+            return false;
+        }
+    }
+
+    // Command line values are parsed as JSON when they can be, so numbers and booleans keep
+    // their type, and as plain strings otherwise
+    json known = to_json();
+    json overrides = json::object();
+    for (const auto& flag : flags) {
+        if (flag.first == "config") {
+            continue;
+        }
+        if (!known.contains(flag.first)) {
+            extra[flag.first] = flag.second;
+            continue;
+        }
+        json value = json::parse(flag.second, nullptr, false);
+        overrides[flag.first] = (value.is_discarded() || known[flag.first].is_string()) ? json(flag.second) : value;
+    }
+    try {
+        return from_json(overrides);
+    } catch (const std::exception& e) {
+        LOGe("config: %s", e.what());
+        return false;
+    }
+}
+
+bool LLMConfig::validate(std::string& error) const {
+    ggml_type type;
+    ggml_numa_strategy numa_strategy;
+    enum llama_pooling_type pooling_type;
+    if (model_path.empty() && models.empty()) {
+        error = "model_path or a models manifest is required";
+    } else if (n_parallel < 1 || n_ctx < 64) {
+        error = "n_parallel must be at least 1 and n_ctx at least 64";
+    } else if (n_batch < 1 || n_ubatch < 1 || n_ubatch > n_batch) {
+        error = "n_ubatch must be between 1 and n_batch";
+    } else if (n_parallel > n_batch) {
+        error = "n_batch must be at least n_parallel, every decode step takes a token of each slot";
+    } else if (n_threads < 0 || n_threads_batch < 0) {
+        error = "thread counts must be positive, or 0 for auto";
+    } else if (request_timeout < 0) {
+        error = "request_timeout must be positive, or 0 for no limit";
+    } else if (conversation_ttl < 0 || max_conversations < 0) {
+        error = "conversation_ttl and max_conversations must be positive, or 0 for no limit";
+    } else if (poll < 0 || poll > 100) {
+        error = "poll must be between 0 and 100";
+    } else if (!parse_kv_type(type_k, type) || !parse_kv_type(type_v, type)) {
+        error = "unsupported KV cache type " + type_k + "/" + type_v;
+    } else if (!parse_numa(numa, numa_strategy)) {
+        error = "numa must be disabled, distribute, isolate or numactl";
+    } else if (!parse_pooling(pooling, pooling_type)) {
+        error = "pooling must be mean, cls or last";
+    } else if (!flash_attn && type_v != "f16" && type_v != "f32" && type_v != "bf16") {
+        error = "a quantized V cache (type_v = " + type_v + ") requires flash_attn";
+    } else {
+        return true;
+    }
+    return false;
+}
+
+static int n_cpus() {
+    return std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+int LLMConfig::threads() const {
+    // Decode is bound by memory bandwidth, one thread per physical core of an SMT host is plenty
+    return n_threads > 0 ? n_threads : std::max(1, n_cpus() / 2);
+}
+
+int LLMConfig::threads_batch() const {
+    return n_threads_batch > 0 ? n_threads_batch : n_cpus();
+}
+
+llama_context_params LLMConfig::context_params(int n_ctx_total, int n_seq_max) const {
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx           = n_ctx_total;
+    params.n_batch         = n_batch;
+    params.n_ubatch        = n_ubatch;
+    params.n_seq_max       = n_seq_max;
+    params.n_threads       = threads();
+    params.n_threads_batch = threads_batch();
+    params.flash_attn      = flash_attn;
+    parse_kv_type(type_k, params.type_k);
+    parse_kv_type(type_v, params.type_v);
+    if (embedding) {
+        // Models with non-causal attention need every sequence within one ubatch
+        params.embeddings = true;
+        params.n_ubatch   = n_batch;
+        parse_pooling(pooling, params.pooling_type);
+    }
+    return params;
+}
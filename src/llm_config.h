@@ -0,0 +1,77 @@
+#ifndef LLM_CONFIG_H
+#define LLM_CONFIG_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include "llama.h"
+#include "ggml-cpu.h"
+
+// Runtime parameters of the model server. Read from a JSON file whose keys are the field names,
+// then overridden by "--key value" command line flags. Thread counts of 0 are resolved from the
+// number of CPUs of the host.
+struct LLMConfig {
+    std::string model_path;
+    std::string models;         // manifest of several models served by name, replaces model_path
+    std::string mmproj_path;
+    uint64_t vision_cache_bytes = 256ULL << 20; // encoded image embeddings kept for images seen again
+    std::string draft_model_path;
+    std::string lora;           // manifest of LoRA adapters on top of the model, chosen per request by name
+    int gpu_layers = 0;
+    bool use_mmap = true;       // map the weights from the file, off reads them into memory owned by the loading thread's node
+
+    int n_parallel = 8;         // slots decoded together
+    int n_ctx = 2048;           // context tokens per slot, the KV cache holds n_ctx * n_parallel
+    int n_batch = 512;          // tokens decoded per scheduler step
+    int n_ubatch = 512;         // physical batch size, at most n_batch
+    int n_threads = 0;          // decode threads
+    int n_threads_batch = 0;    // prefill threads
+    std::string cpu_mask;       // CPUs of the decode threadpool, hex mask ("0xFF") or range ("0-7"), empty for any
+    std::string cpu_mask_batch; // CPUs of the prefill threadpool
+    bool cpu_strict = true;     // pin every thread to one CPU of its mask
+    int poll = 50;              // busy-wait level of idle pool threads between graphs, 0-100
+    std::string type_k = "f16"; // KV cache types: f32, f16, bf16, q8_0, q5_1, q5_0, q4_1, q4_0, iq4_nl
+    std::string type_v = "f16"; // a quantized V cache needs flash_attn
+    bool flash_attn = false;
+    uint64_t kv_budget = 0;     // bytes the KV caches may use, 0 for the memory available at load time
+    bool context_shift = true;
+    bool embedding = false;     // embeddings mode: no generation, every request is batched through embed()
+    std::string pooling;        // mean, cls or last, empty for the model's own (mean if it has none)
+    // NUMA placement: disabled, distribute or isolate (one instance per node, each with its own
+    // weights, KV cache and threadpools pinned to the node's CPUs), numactl (one instance inside the
+    // CPU set given by numactl)
+    std::string numa = "disabled";
+
+    std::string snapshot_dir = "kv_snapshots";  // empty disables KV snapshots
+    uint64_t snapshot_bytes = 2ULL << 30;
+    int port = 8080;
+    double request_timeout = 0; // seconds a chat request may take when it does not set its own, 0 for no limit
+    // Conversations are forgotten after this many idle seconds, and beyond this many without a
+    // slot the least recently used go first. 0 for no limit
+    double conversation_ttl = 3600;
+    int max_conversations = 1024;
+
+    bool load_file(const std::string& path);
+    bool save_file(const std::string& path) const;
+    // "--config file" is applied first. Other arguments are collected in positional, unknown
+    // flags in extra so the caller can handle its own modes
+    bool parse_args(int argc, char** argv, std::vector<std::string>& positional, std::map<std::string, std::string>& extra);
+
+    nlohmann::json to_json() const;
+    bool from_json(const nlohmann::json& j);
+    // Checks ranges and combinations, the message says what is wrong
+    bool validate(std::string& error) const;
+
+    int threads() const;
+    int threads_batch() const;
+    // Context parameters for a context holding n_ctx_total cells in n_seq_max sequences
+    llama_context_params context_params(int n_ctx_total, int n_seq_max) const;
+
+    static bool parse_kv_type(const std::string& name, ggml_type& type);
+    static bool parse_numa(const std::string& name, ggml_numa_strategy& strategy);
+    static bool parse_pooling(const std::string& name, enum llama_pooling_type& pooling);
+};
+
+#endif // LLM_CONFIG_H
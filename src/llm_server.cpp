@@ -1,16 +1,31 @@
 #include <iostream>
 #include "LLM.h"
+#include "json_schema_grammar.h"
+#include "trace.h"
+#include "llm_config.h"
+#include "llm_autotune.h"
+#include "llm_bench.h"
+#include "model_registry.h"
 #include "httplib.h"
 #include <nlohmann/json.hpp>
 #include <ctime>
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <future>
+#include <array>
+#include <cctype>
+#include <algorithm>
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 using json = nlohmann::json;
 
 // 构造 OpenAI 风格的 JSON 响应
-json build_openai_response(const std::string& input, const std::string& output, const std::string& model_name) {
+json build_openai_response(const LLM::Result& result, const std::string& model_name) {
     json response;
     response["id"] = "chatcmpl-" + std::to_string(std::time(nullptr));
     response["object"] = "chat.completion";
@@ -19,51 +34,222 @@ json build_openai_response(const std::string& input, const std::string& output,
 
     json choice;
     choice["index"] = 0;
-    choice["finish_reason"] = "stop";
+    choice["finish_reason"] = result.finish_reason;
 
     json message;
     message["role"] = "assistant";
-    message["content"] = output;
+    message["content"] = result.content;
+    if (!result.reasoning.empty()) {
+        message["reasoning_content"] = result.reasoning;
+    }
     choice["message"] = message;
 
     response["choices"] = {choice};
 
-    // token 统计（示例）
-    // 注意：这是一个非常粗略的估算
-    int prompt_tokens = input.length() / 4;
-    int completion_tokens = output.length() / 4;
-    int total_tokens = prompt_tokens + completion_tokens;
+    // token 统计，来自调度器的实际计数
+    response["usage"]["prompt_tokens"] = result.prompt_tokens;
+    response["usage"]["completion_tokens"] = result.completion_tokens;
+    response["usage"]["total_tokens"] = result.prompt_tokens + result.completion_tokens;
+    response["usage"]["prompt_tokens_details"]["cached_tokens"] = result.cached_tokens;
 
-    response["usage"]["prompt_tokens"] = prompt_tokens;
-    response["usage"]["completion_tokens"] = completion_tokens;
-    response["usage"]["total_tokens"] = total_tokens;
+    // 投机解码统计：草稿模型提出的 token 数和被目标模型接受的 token 数
+    if (result.draft_tokens > 0) {
+        response["speculative"]["draft_tokens"] = result.draft_tokens;
+        response["speculative"]["accepted_tokens"] = result.draft_accepted;
+        response["speculative"]["acceptance_rate"] = (double) result.draft_accepted / result.draft_tokens;
+    }
 
     return response;
 }
 
+// 构造 OpenAI 风格的流式 chunk（chat.completion.chunk）
+json build_openai_chunk(const std::string& id, const std::string& model_name, const std::string& content, bool first, const char* finish_reason, bool reasoning = false) {
+    json chunk;
+    chunk["id"] = id;
+    chunk["object"] = "chat.completion.chunk";
+    chunk["created"] = std::time(nullptr);
+    chunk["model"] = model_name;
+
+    json choice;
+    choice["index"] = 0;
+    choice["delta"] = json::object();
+    if (first) {
+        choice["delta"]["role"] = "assistant";
+    }
+    if (!content.empty()) {
+        choice["delta"][reasoning ? "reasoning_content" : "content"] = content;
+    }
+    choice["finish_reason"] = finish_reason ? json(finish_reason) : json(nullptr);
+    chunk["choices"] = {choice};
+
+    return chunk;
+}
+
+// 解码 base64，忽略换行等空白，遇到非法字符返回 false
+static bool base64_decode(const std::string& in, std::string& out) {
+    static const std::array<int8_t, 256> table = [] {
+        std::array<int8_t, 256> t;
+        t.fill(-1);
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; i++) {
+            t[(unsigned char) alphabet[i]] = i;
+        }
+        return t;
+    }();
+
+    out.clear();
+    out.reserve(in.size() / 4 * 3);
+    uint32_t bits = 0;
+    int n_bits = 0;
+    for (unsigned char c : in) {
+        if (c == '=') {
+            break;
+        }
+        if (isspace(c)) {
+            continue;
+        }
+        if (table[c] < 0) {
+            return false;
+        }
+        bits = (bits << 6) | table[c];
+        n_bits += 6;
+        if (n_bits >= 8) {
+            n_bits -= 8;
+            out.push_back((char) ((bits >> n_bits) & 0xFF));
+        }
+    }
+    return true;
+}
+
+// OpenAI 风格的 messages：服务端按 conversation_id 自己保存历史，这里只取最后一条 user 消息。
+// content 可以是字符串，也可以是 text / image_url 片段数组，图片只支持 base64 的 data URL，解码后放进 images
+static std::string parse_messages(const json& messages, std::vector<std::string>& images) {
+    if (messages.is_string()) {
+        return messages.get<std::string>();
+    }
+    const json* last_user = nullptr;
+    for (const auto& message : messages) {
+        if (message.value("role", "") == "user") {
+            last_user = &message;
+        }
+    }
+    if (!last_user || !last_user->contains("content")) {
+        return "";
+    }
+    const json& content = (*last_user)["content"];
+    if (content.is_string()) {
+        return content.get<std::string>();
+    }
+
+    std::string text;
+    for (const auto& part : content) {
+        std::string type = part.value("type", "");
+        if (type == "text") {
+            text += part.value("text", "");
+        } else if (type == "image_url") {
+            const json& image_url = part.at("image_url");
+            std::string url = image_url.is_string() ? image_url.get<std::string>() : image_url.value("url", "");
+            size_t comma = url.find(',');
+            if (url.rfind("data:", 0) != 0 || comma == std::string::npos || url.substr(0, comma).find(";base64") == std::string::npos) {
+                throw std::invalid_argument("image_url must be a base64 data URL");
+            }
+            std::string data;
+            if (!base64_decode(url.substr(comma + 1), data)) {
+                throw std::invalid_argument("image_url is not valid base64");
+            }
+            images.push_back(std::move(data));
+        }
+    }
+    return text;
+}
+
+// 生成线程和HTTP线程之间传递token的队列：LLM的回调只负责入队，不会被慢客户端阻塞
+struct TokenChannel {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::pair<bool, std::string>> pieces; // 是否为推理内容, 文本
+    bool closed = false; // 客户端已断开
+
+    bool push(std::string_view piece, bool reasoning = false) {
+        std::lock_guard<std::mutex> lock(mtx);
+        pieces.emplace_back(reasoning, std::string(piece));
+        cv.notify_one();
+        return !closed;
+    }
+};
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <model_path> [mmproj_path] [image_path]\n", argv[0]);
+    // 配置来源：--config 配置文件，再用 --key value 覆盖；位置参数兼容旧用法
+    LLMConfig config;
+    std::vector<std::string> positional;
+    std::map<std::string, std::string> options;
+    if (!config.parse_args(argc, argv, positional, options)) {
         return 1;
     }
+    if (positional.size() > 0) config.model_path = positional[0];
+    if (positional.size() > 1) config.mmproj_path = positional[1];
+    std::string image_path = positional.size() > 2 ? positional[2] : "";
+    if (positional.size() > 3) config.draft_model_path = positional[3];
 
-    LLM llm;
+    std::string error;
+    if (!config.validate(error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        fprintf(stderr, "Usage: %s <model_path> [mmproj_path] [image_path] [draft_model_path] [--config file.json] [--models manifest.json] [--n_ctx 4096 ...] [--autotune out.json] [--bench n_tokens]\n", argv[0]);
+        return 1;
+    }
 
-    if (!llm.load(argv[1], (argc > 2) ? argv[2] : "", 0)) {
+    // 自动调参模式：在本机对当前模型扫描线程数、batch大小和flash attention，把最快的配置写入文件后退出
+    if (options.count("autotune")) {
+        return llm_autotune(config, options["autotune"]) ? 0 : 1;
+    }
+    // 基准模式：测量解码循环里每个token在主机侧的开销（反分词、UTF-8拼接、输出），新旧两种做法对比后退出
+    if (options.count("bench")) {
+        return llm_bench(config, atoi(options["bench"].c_str())) ? 0 : 1;
+    }
+    for (const auto& option : options) {
+        fprintf(stderr, "unknown option --%s\n", option.first.c_str());
         return 1;
     }
-    // 测试模型是否正常工作
-    std::cout << "Model loaded successfully." << std::endl;
-    std::string user_input = "你好";
-    std::string image_path = (argc > 3) ? argv[3] : "";
-    std::string response = llm.send(user_input, image_path);
 
-    std::cout << "Response: " << response << std::endl;
+    // 性能追踪：LLM_TRACE=1/2/3 分别记录每个请求/每步解码/每个token的事件，写成 Chrome trace 格式
+    if (const char* level = getenv("LLM_TRACE")) {
+        const char* path = getenv("LLM_TRACE_FILE");
+        trace::start(atoi(level), path ? path : "llm_trace.json");
+    }
+
+    // 多模型：models 清单把模型名映射到各自的 GGUF 和参数，首次请求时才加载，超出内存预算按LRU卸载空闲模型
+    // 单模型时按模型文件名注册，任何 "model" 都路由到它。NUMA 模式下每个模型在每个节点各有一个实例
+    ModelRegistry models;
+    if (!config.models.empty()) {
+        if (!models.load_manifest(config.models, config)) {
+            return 1;
+        }
+    } else {
+        std::string name = config.model_path.substr(config.model_path.find_last_of('/') + 1);
+        name = name.substr(0, name.rfind(".gguf"));
+        if (!models.add(name, config)) {
+            return 1;
+        }
+
+        // 测试模型是否正常工作，embedding 模型不能生成文本
+        std::cout << "Model loaded successfully." << std::endl;
+        if (!config.embedding) {
+            std::string user_input = "你好";
+            std::string response = models.get("")->send(user_input, image_path);
+
+            std::cout << "Response: " << response << std::endl;
+        }
+    }
 
 
     // HTTP
 
     httplib::Server svr;
+    // 并发请求都在 LLM 内部按 slot 合批解码，工作线程数至少要覆盖所有 slot
+    const size_t n_parallel = models.max_parallel();
+    svr.new_task_queue = [n_parallel] {
+        return new httplib::ThreadPool(std::max<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT, n_parallel * 2));
+    };
 
     svr.Post("/v1/chat/completions", [&](const httplib::Request& req, httplib::Response& res) {
         if (req.get_header_value("Content-Type") != "application/json") {
@@ -77,24 +263,172 @@ int main(int argc, char **argv) {
             auto input_json = json::parse(req.body);
 
             // 提取 model 和 messages
-            std::string model = input_json.value("model", "my-llm");
+            // 按 model 字段选择模型，不传则用默认模型；未加载的模型在这里加载
+            std::string model = input_json.value("model", models.default_name());
+            std::shared_ptr<NumaRouter> llm = models.get(model);
+            if (!llm) {
+                res.status = 404;
+                res.set_content("Model '" + model + "' not found or failed to load.", "text/plain");
+                return;
+            }
 
             // 从 "messages" 字段提取prompt。
             // 注意：标准的OpenAI API格式中，"messages"应该是一个包含 "role" 和 "content" 的对象数组。
             // 这里我们简化处理，直接读取字符串。
-            std::string prompt = input_json.value("messages", "");
+            // 也支持 OpenAI 的消息数组，user 消息里的 image_url 图片会随请求一起送给视觉模型
+            std::vector<std::string> images;
+            std::string prompt = input_json.contains("messages") ? parse_messages(input_json["messages"], images) : "";
 
-            if (prompt.empty()) {
+            if (prompt.empty() && images.empty()) {
                 res.status = 400;
                 res.set_content("Invalid JSON: missing 'messages' field or it's empty.", "text/plain");
                 return;
             }
 
-            // 调用模型
-            std::string output = llm.send(prompt, "");
+            // 可选的会话ID，相同ID的请求共享聊天历史和KV缓存，不传则是一次性请求
+            std::string conversation_id = input_json.value("conversation_id", "");
+
+            // 结构化输出：tools 或 response_format 编译成 GBNF 语法约束采样，模型只能生成合法的 JSON
+            // tools 的输出格式固定为 {"tool_name": "...", "parameters": {...}}
+            LLM::Options options;
+            options.images = std::move(images);
+
+            // 生成长度和超时：max_tokens（或 max_completion_tokens）限制生成的token数，
+            // timeout（秒，含排队时间）不传则用配置的 request_timeout。客户端断开时通过 cancel 取消请求
+            options.max_tokens = input_json.value("max_completion_tokens", input_json.value("max_tokens", 0));
+            options.timeout_ms = (int64_t) (input_json.value("timeout", config.request_timeout) * 1000);
+            options.cancel = std::make_shared<std::atomic<bool>>(false);
+
+            // 采样参数，不传则用默认值；temperature 为 0 时贪心解码，结果确定
+            options.temperature = input_json.value("temperature", -1.0f);
+            options.top_p = input_json.value("top_p", -1.0f);
+            options.top_k = input_json.value("top_k", -1);
+            options.seed = input_json.value("seed", (uint32_t) LLAMA_DEFAULT_SEED);
+
+            // 推理控制：max_thinking_tokens 限制 <think> 内的token数，用完后强制插入 </think>；
+            // reasoning 为 "off"/false 时在模板里预填空的 think 块，直接生成回答
+            options.max_thinking_tokens = input_json.value("max_thinking_tokens", -1);
+            if (input_json.contains("reasoning")) {
+                const json& reasoning = input_json["reasoning"];
+                options.reasoning = reasoning.is_string() ? reasoning.get<std::string>() != "off" : reasoning.get<bool>();
+            }
+
+            // stop：字符串或字符串数组，生成出其中任何一个就结束，停止串本身不输出
+            if (input_json.contains("stop") && !input_json["stop"].is_null()) {
+                const json& stop = input_json["stop"];
+                options.stop = stop.is_string() ? std::vector<std::string>{stop.get<std::string>()} : stop.get<std::vector<std::string>>();
+            }
+
+            // 可选的 LoRA 适配器，按名字从 lora 清单中选择，不传则用基础模型
+            options.lora = input_json.value("lora", "");
+            if (!options.lora.empty()) {
+                auto names = llm->lora_names();
+                if (std::find(names.begin(), names.end(), options.lora) == names.end()) {
+                    res.status = 404;
+                    res.set_content("LoRA adapter '" + options.lora + "' not found.", "text/plain");
+                    return;
+                }
+            }
+            if (input_json.contains("tools")) {
+                options.grammar = schema_to_gbnf(tools_to_schema(input_json["tools"]));
+            } else if (input_json.contains("response_format")) {
+                const json& format = input_json["response_format"];
+                std::string type = format.value("type", "text");
+                if (type == "json_schema") {
+                    options.grammar = schema_to_gbnf(format.at("json_schema").at("schema"));
+                } else if (type == "json_object") {
+                    options.grammar = schema_to_gbnf(json::object({{"type", "object"}}));
+                }
+            }
+
+            // 流式输出：text/event-stream，每生成一段token就推送一个chunk
+            if (input_json.value("stream", false)) {
+                res.set_header("Cache-Control", "no-cache");
+                res.set_chunked_content_provider("text/event-stream",
+                    [llm, prompt, model, conversation_id, options](size_t, httplib::DataSink& sink) mutable {
+                        auto channel = std::make_shared<TokenChannel>();
+                        // 推理内容放在 delta.reasoning_content 里单独推送
+                        options.on_reasoning = [channel](std::string_view piece) {
+                            return channel->push(piece, true);
+                        };
+                        auto result = llm->send_async(prompt, [channel](std::string_view piece) {
+                            return channel->push(piece);
+                        }, "", conversation_id, options);
+
+                        const std::string id = "chatcmpl-" + std::to_string(std::time(nullptr));
+                        bool first = true;
+                        bool ok = true;
+                        while (ok) {
+                            std::unique_lock<std::mutex> lock(channel->mtx);
+                            // future 就绪说明所有 token 都已入队，先判断就绪再判断队列为空
+                            bool done = result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                            if (channel->pieces.empty()) {
+                                if (done) {
+                                    break;
+                                }
+                                // prefill 期间没有 token 可写，靠 is_writable 发现客户端已断开
+                                if (!sink.is_writable()) {
+                                    channel->closed = true;
+                                    ok = false;
+                                    break;
+                                }
+                                channel->cv.wait_for(lock, std::chrono::milliseconds(50));
+                                continue;
+                            }
+                            auto piece = std::move(channel->pieces.front());
+                            channel->pieces.pop_front();
+                            lock.unlock();
+
+                            std::string event = "data: " + build_openai_chunk(id, model, piece.second, first, nullptr, piece.first).dump() + "\n\n";
+                            first = false;
+                            if (!sink.write(event.data(), event.size())) {
+                                std::lock_guard<std::mutex> guard(channel->mtx);
+                                channel->closed = true;
+                                ok = false;
+                            }
+                        }
+                        // 客户端断开后立即释放 slot，不必等到下一个 token
+                        if (!ok) {
+                            *options.cancel = true;
+                        }
+
+                        if (ok) {
+                            // 状态码已经发出，请求失败时推送一个 error 事件
+                            const LLM::Result final = result.get();
+                            std::string event;
+                            if (final.finish_reason == "error") {
+                                json error = {{"error", {{"message", final.error}, {"type", final.bad_request ? "invalid_request_error" : "server_error"}}}};
+                                event = "data: " + error.dump() + "\n\n";
+                            } else {
+                                event = "data: " + build_openai_chunk(id, model, "", first, final.finish_reason.c_str()).dump() + "\n\n";
+                            }
+                            event += "data: [DONE]\n\n";
+                            sink.write(event.data(), event.size());
+                            sink.done();
+                        }
+                        return ok;
+                    });
+                return;
+            }
+
+            // 调用模型，等待期间客户端断开则取消请求
+            auto future = llm->send_async(prompt, nullptr, "", conversation_id, options);
+            while (future.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+                if (req.is_connection_closed()) {
+                    *options.cancel = true;
+                }
+            }
+            LLM::Result result = future.get();
+
+            // 请求没能执行（提示词过长、语法无效、图片无法读取、模型未加载等），返回错误而不是空回答
+            if (result.finish_reason == "error") {
+                res.status = result.bad_request ? 400 : 500;
+                res.set_content(result.error, "text/plain");
+                return;
+            }
 
             // 构造 OpenAI 风格响应
-            auto response_json = build_openai_response(prompt, output, model);
+            auto response_json = build_openai_response(result, model);
 
             // 返回 JSON 响应
             res.set_content(response_json.dump(4), "application/json"); // dump(4) 用于格式化输出
@@ -105,11 +439,103 @@ int main(int argc, char **argv) {
     });
 
 
-    std::cout << "OpenAI-style API server running at http://localhost:8080/v1/chat/completions" << std::endl;
-    svr.listen("0.0.0.0", 8080);
+    // OpenAI 兼容的 embeddings 接口：input 可以是字符串或字符串数组，多个输入打包进同一个batch，
+    // 每个输入占一个序列，按序列池化后做L2归一化。模型需要以 embedding 模式加载
+    svr.Post("/v1/embeddings", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            auto input_json = json::parse(req.body);
+            std::string model = input_json.value("model", models.default_name());
+            std::vector<std::string> inputs;
+            const json& input = input_json.at("input");
+            if (input.is_string()) {
+                inputs.push_back(input.get<std::string>());
+            } else {
+                inputs = input.get<std::vector<std::string>>();
+            }
+            if (inputs.empty()) {
+                res.status = 400;
+                res.set_content("Invalid JSON: 'input' is empty.", "text/plain");
+                return;
+            }
+
+            std::shared_ptr<NumaRouter> llm = models.get(model);
+            if (!llm) {
+                res.status = 404;
+                res.set_content("Model '" + model + "' not found or failed to load.", "text/plain");
+                return;
+            }
+
+            std::vector<std::vector<float>> embeddings;
+            int n_tokens = 0;
+            std::string error;
+            bool bad_request = false;
+            // 输入无法计算（token数为0或超过n_batch、模型不是embedding模式）返回400，模型未加载、解码失败返回500
+            if (!llm->embed(inputs, embeddings, n_tokens, error, bad_request)) {
+                res.status = bad_request ? 400 : 500;
+                res.set_content(error, "text/plain");
+                return;
+            }
+
+            json data = json::array();
+            for (size_t i = 0; i < embeddings.size(); i++) {
+                data.push_back({{"object", "embedding"}, {"index", i}, {"embedding", embeddings[i]}});
+            }
+            json response = {
+                {"object", "list"},
+                {"data", data},
+                {"model", model},
+                {"usage", {{"prompt_tokens", n_tokens}, {"total_tokens", n_tokens}}},
+            };
+            res.set_content(response.dump(), "application/json");
+        } catch (const json::exception& e) {
+            res.status = 400;
+            res.set_content("Invalid JSON or missing fields: " + std::string(e.what()), "text/plain");
+        } catch (const std::exception& e) {
+            res.status = 500;
+            res.set_content(e.what(), "text/plain");
+        }
+    });
+
+    // KV缓存占用：每个token、每个会话的字节数，以及预算内最多能容纳的会话数。多模型时按模型名列出已加载的模型
+    svr.Get("/v1/kv_memory", [&](const httplib::Request&, httplib::Response& res) {
+        json body = json::object();
+        for (const auto& item : models.loaded()) {
+            json nodes = json::array();
+            int n_sessions = 0;
+            int max_sessions = 0;
+            for (const auto& kv : item.second->kv_memory()) {
+                nodes.push_back(kv.to_json());
+                n_sessions += kv.n_sessions;
+                max_sessions += kv.max_sessions;
+            }
+            body[item.first] = nodes.size() == 1 ? nodes[0] : json{{"n_sessions", n_sessions}, {"max_sessions", max_sessions}, {"nodes", nodes}};
+        }
+        if (config.models.empty() && body.size() == 1) {
+            body = body.begin().value();
+        }
+        res.set_content(body.dump(4), "application/json");
+    });
+
+    // 可用模型列表，loaded 表示当前是否已加载
+    svr.Get("/v1/models", [&](const httplib::Request&, httplib::Response& res) {
+        auto resident = models.loaded();
+        json data = json::array();
+        for (const auto& name : models.names()) {
+            json entry = {{"id", name}, {"object", "model"}, {"owned_by", "local"}, {"loaded", resident.count(name) > 0}};
+            if (resident.count(name)) {
+                entry["lora"] = resident[name]->lora_names();
+            }
+            data.push_back(entry);
+        }
+        res.set_content(json{{"object", "list"}, {"data", data}}.dump(4), "application/json");
+    });
+
+    std::cout << "OpenAI-style API server running at http://localhost:" << config.port << "/v1/chat/completions" << std::endl;
+    svr.listen("0.0.0.0", config.port);
 
     // 清理资源
-    llm.unload();
+    models.unload();
+    trace::stop();
 
     return 0;
 }
@@ -0,0 +1,225 @@
+#include "model_registry.h"
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+ModelRegistry::~ModelRegistry() {
+    unload();
+}
+
+bool ModelRegistry::load_manifest(const std::string& path, const LLMConfig& base) {
+    json manifest;
+    try {
+        std::ifstream in(path);
+        if (!in) {
+            LOGe("models: cannot open %s", path.c_str());
+            return false;
+        }
+        manifest = json::parse(in);
+        if (!manifest.contains("models") || !manifest["models"].is_object() || manifest["models"].empty()) {
+            LOGe("models: %s has no \"models\" object", path.c_str());
+            return false;
+        }
+
+        for (const auto& item : manifest["models"].items()) {
+            std::unique_ptr<Entry> entry(new Entry());
+            entry->name = item.key();
+            entry->config = base;
+            entry->config.models.clear();
+            entry->config.model_path.clear();
+            if (!entry->config.from_json(item.value())) {
+                LOGe("models: invalid settings for %s", item.key().c_str());
+                return false;
+            }
+            // Snapshots hold the KV of one model, every model gets its own directory
+            if (!base.snapshot_dir.empty() && !item.value().contains("snapshot_dir")) {
+                entry->config.snapshot_dir = base.snapshot_dir + "/" + item.key();
+            }
+            std::string error;
+            if (!entry->config.validate(error)) {
+                LOGe("models: %s: %s", item.key().c_str(), error.c_str());
+                return false;
+            }
+            entry->bytes = file_bytes(entry->config);
+            entries[item.key()] = std::move(entry);
+        }
+        default_model = manifest.value("default", entries.begin()->first);
+        budget = manifest.value("memory_budget", (uint64_t) 0);
+    } catch (const std::exception& e) {
+        LOGe("models: %s: %s", path.c_str(), e.what());
+        return false;
+    }
+
+    if (!entries.count(default_model)) {
+        LOGe("models: default model %s is not in the manifest", default_model.c_str());
+        return false;
+    }
+    if (budget == 0) {
+        budget = KVMemory::available_bytes();
+    }
+    strict = true;
+    LOGi("models: %zu models, default %s, memory budget %.1f MiB", entries.size(), default_model.c_str(),
+         budget / (1024.0 * 1024.0));
+    return true;
+}
+
+bool ModelRegistry::add(const std::string& name, const LLMConfig& config) {
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->name = name;
+    entry->config = config;
+    entry->bytes = file_bytes(config);
+    entries[name] = std::move(entry);
+    default_model = name;
+    strict = false;
+    return get(name) != nullptr;
+}
+
+ModelRegistry::Entry* ModelRegistry::find(const std::string& name) {
+    auto it = entries.find(name.empty() ? default_model : name);
+    if (it == entries.end()) {
+        return strict ? nullptr : entries[default_model].get();
+    }
+    return it->second.get();
+}
+
+std::shared_ptr<NumaRouter> ModelRegistry::get(const std::string& name) {
+    Entry* entry = nullptr;
+    std::vector<std::shared_ptr<NumaRouter>> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        entry = find(name);
+        if (!entry) {
+            return nullptr;
+        }
+        entry->last_used = ++clock;
+        if (entry->router) {
+            return entry->router;
+        }
+    }
+
+    std::lock_guard<std::mutex> loading(entry->load_mutex);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (entry->router) {
+            return entry->router;
+        }
+        evicted = make_room(*entry);
+    }
+    // The last reference unloads, outside the lock so other models keep serving meanwhile
+    evicted.clear();
+
+    LOGi("models: loading %s from %s", entry->name.c_str(), entry->config.model_path.c_str());
+    auto router = std::make_shared<NumaRouter>();
+    if (!router->load(entry->config)) {
+        LOGe("models: loading %s failed", entry->name.c_str());
+        return nullptr;
+    }
+    if (!entry->config.snapshot_dir.empty()) {
+        router->enable_snapshots(entry->config.snapshot_dir, entry->config.snapshot_bytes);
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    entry->router = router;
+    entry->bytes = router->memory_bytes();
+    LOGi("models: %s loaded, %.1f MiB", entry->name.c_str(), entry->bytes / (1024.0 * 1024.0));
+    return router;
+}
+
+std::vector<std::shared_ptr<NumaRouter>> ModelRegistry::make_room(const Entry& entry) {
+    std::vector<std::shared_ptr<NumaRouter>> evicted;
+    if (budget == 0) {
+        return evicted;
+    }
+    uint64_t used = 0;
+    for (const auto& item : entries) {
+        if (item.second->router) {
+            used += item.second->bytes;
+        }
+    }
+
+    while (used + entry.bytes > budget) {
+        // Least recently used among the models nobody is using right now
+        Entry* victim = nullptr;
+        for (const auto& item : entries) {
+            Entry* e = item.second.get();
+            if (e == &entry || !e->router || e->router.use_count() > 1 || e->router->pending() > 0) {
+                continue;
+            }
+            if (!victim || e->last_used < victim->last_used) {
+                victim = e;
+            }
+        }
+        if (!victim) {
+            LOGe("models: loading %s exceeds the memory budget, the other models are busy", entry.name.c_str());
+            break;
+        }
+        LOGi("models: unloading %s (%.1f MiB) to make room for %s", victim->name.c_str(),
+             victim->bytes / (1024.0 * 1024.0), entry.name.c_str());
+        used -= victim->bytes;
+        victim->bytes = file_bytes(victim->config);
+        evicted.push_back(std::move(victim->router));
+        victim->router.reset();
+    }
+    return evicted;
+}
+
+std::map<std::string, std::shared_ptr<NumaRouter>> ModelRegistry::loaded() {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::map<std::string, std::shared_ptr<NumaRouter>> result;
+    for (const auto& item : entries) {
+        if (item.second->router) {
+            result[item.first] = item.second->router;
+        }
+    }
+    return result;
+}
+
+std::vector<std::string> ModelRegistry::names() const {
+    std::vector<std::string> result;
+    for (const auto& item : entries) {
+        result.push_back(item.first);
+    }
+    return result;
+}
+
+int ModelRegistry::max_parallel() const {
+    int n = 0;
+    for (const auto& item : entries) {
+        n += item.second->config.n_parallel * NumaRouter::node_count(item.second->config);
+    }
+    return n;
+}
+
+void ModelRegistry::unload() {
+    std::vector<std::shared_ptr<NumaRouter>> routers;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& item : entries) {
+            if (item.second->router) {
+                routers.push_back(std::move(item.second->router));
+                item.second->router.reset();
+            }
+        }
+    }
+    for (auto& router : routers) {
+        router->unload();
+    }
+}
+
+uint64_t ModelRegistry::file_bytes(const LLMConfig& config) {
+    std::error_code ec;
+    uint64_t bytes = 0;
+    for (const std::string& path : {config.model_path, config.draft_model_path}) {
+        if (!path.empty()) {
+            uint64_t size = fs::file_size(path, ec);
+            bytes += ec ? 0 : size;
+        }
+    }
+    return bytes;
+}
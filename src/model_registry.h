@@ -0,0 +1,64 @@
+#ifndef MODEL_REGISTRY_H
+#define MODEL_REGISTRY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include "numa_router.h"
+#include "llm_config.h"
+
+// Models served by name. The manifest is a JSON file
+//
+//   {"memory_budget": 34359738368, "default": "router",
+//    "models": {"router": {"model_path": "small.gguf", "n_ctx": 4096},
+//               "answer": {"model_path": "large.gguf", "type_k": "q8_0", "flash_attn": true}}}
+//
+// where every model's settings override the server configuration. A model is loaded when it is
+// first asked for. Before loading one, the least recently used idle models are unloaded until the
+// weights and KV caches of the resident ones fit memory_budget (0 or missing: the memory available
+// when the manifest is read). Requests in flight keep their model alive until they finish.
+class ModelRegistry {
+public:
+    ~ModelRegistry();
+
+    bool load_manifest(const std::string& path, const LLMConfig& base);
+    // A single model, which then serves every name
+    bool add(const std::string& name, const LLMConfig& config);
+
+    // The model called name, the default one for an empty name; nullptr if there is no such model
+    // or it cannot be loaded
+    std::shared_ptr<NumaRouter> get(const std::string& name);
+    const std::string& default_name() const { return default_model; }
+    // Loaded models by name
+    std::map<std::string, std::shared_ptr<NumaRouter>> loaded();
+    std::vector<std::string> names() const;
+    // Slots of all models on all nodes, what the HTTP server may have in flight at most
+    int max_parallel() const;
+    void unload();
+
+private:
+    struct Entry {
+        std::string name;
+        LLMConfig config;
+        std::shared_ptr<NumaRouter> router;
+        uint64_t bytes = 0;         // resident size, the size of the files until it has been loaded
+        uint64_t last_used = 0;
+        std::mutex load_mutex;      // one load at a time per model, others wait for it
+    };
+
+    std::map<std::string, std::unique_ptr<Entry>> entries;
+    std::string default_model;
+    bool strict = false;            // unknown names are an error, not the default model
+    uint64_t budget = 0;
+    uint64_t clock = 0;
+    std::mutex mtx;
+
+    Entry* find(const std::string& name);
+    std::vector<std::shared_ptr<NumaRouter>> make_room(const Entry& entry);
+    static uint64_t file_bytes(const LLMConfig& config);
+};
+
+#endif // MODEL_REGISTRY_H
@@ -0,0 +1,259 @@
+#include "numa_router.h"
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <pthread.h>
+#include <sched.h>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+namespace fs = std::filesystem;
+
+NumaRouter::~NumaRouter() {
+    unload();
+}
+
+bool NumaRouter::load(const LLMConfig& config) {
+    ggml_numa_strategy strategy = GGML_NUMA_STRATEGY_DISABLED;
+    if (!LLMConfig::parse_numa(config.numa, strategy)) {
+        LOGe("numa: unknown strategy %s", config.numa.c_str());
+        return false;
+    }
+    // ggml keeps the NUMA setup of the process, several models share the first one
+    static std::once_flag numa_once;
+    if (strategy != GGML_NUMA_STRATEGY_DISABLED) {
+        std::call_once(numa_once, [strategy] { llama_numa_init(strategy); });
+    }
+
+    conversation_ttl = (int64_t) (config.conversation_ttl * 1e6);
+    auto expired = [this](const std::string& conversation_id) { forget(conversation_id); };
+
+    std::map<int, std::vector<int>> cpus;
+    if (strategy == GGML_NUMA_STRATEGY_DISTRIBUTE || strategy == GGML_NUMA_STRATEGY_ISOLATE) {
+        cpus = node_cpus();
+        if (cpus.size() < 2) {
+            LOGi("numa: %zu node(s) found, running a single instance", cpus.size());
+            cpus.clear();
+        }
+    }
+
+    if (cpus.empty()) {
+        Node node;
+        node.llm.reset(new LLM());
+        node.llm->set_conversation_expired(expired);
+        if (!node.llm->load(config)) {
+            return false;
+        }
+        nodes.push_back(std::move(node));
+        return true;
+    }
+
+    for (const auto& entry : cpus) {
+        Node node;
+        node.id = entry.first;
+        node.cpus = entry.second;
+        node.llm.reset(new LLM());
+        node.llm->set_conversation_expired(expired);
+
+        // Thread counts apply per node, auto means the same split as a whole host would get
+        LLMConfig node_config = config;
+        node_config.cpu_mask = node_config.cpu_mask_batch = cpu_mask(node.cpus);
+        node_config.n_threads = config.n_threads > 0 ? config.n_threads : std::max(1, (int) node.cpus.size() / 2);
+        node_config.n_threads_batch = config.n_threads_batch > 0 ? config.n_threads_batch : (int) node.cpus.size();
+        // Pages are placed on the node of the thread touching them first. Reading the weights
+        // instead of mapping them gives every node a local copy, and the scheduler thread started
+        // by load() inherits the affinity
+        node_config.use_mmap = false;
+        if (config.kv_budget > 0) {
+            node_config.kv_budget = config.kv_budget / cpus.size();
+        }
+
+        bool ok = false;
+        std::thread loader([&] {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : node.cpus) {
+                CPU_SET(cpu, &set);
+            }
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                LOGe("numa: cannot pin the loader to node %d", node.id);
+            }
+            ok = node.llm->load(node_config);
+        });
+        loader.join();
+        if (!ok) {
+            LOGe("numa: loading on node %d failed", node.id);
+            unload();
+            return false;
+        }
+        LOGi("numa: node %d ready, %zu cpus (%s)", node.id, node.cpus.size(), node_config.cpu_mask.c_str());
+        nodes.push_back(std::move(node));
+    }
+    return true;
+}
+
+void NumaRouter::unload() {
+    for (auto& node : nodes) {
+        node.llm->unload();
+    }
+    nodes.clear();
+    std::lock_guard<std::mutex> lock(mtx);
+    conversation_node.clear();
+}
+
+bool NumaRouter::enable_snapshots(const std::string& dir, uint64_t max_bytes) {
+    bool ok = true;
+    for (auto& node : nodes) {
+        ok = node.llm->enable_snapshots(dir, max_bytes) && ok;
+    }
+    return ok;
+}
+
+int NumaRouter::pending() const {
+    int n = 0;
+    for (const auto& node : nodes) {
+        n += node.llm->pending();
+    }
+    return n;
+}
+
+uint64_t NumaRouter::memory_bytes() const {
+    uint64_t bytes = 0;
+    for (const auto& node : nodes) {
+        bytes += node.llm->memory_bytes();
+    }
+    return bytes;
+}
+
+std::vector<KVMemory> NumaRouter::kv_memory() const {
+    std::vector<KVMemory> result;
+    for (const auto& node : nodes) {
+        result.push_back(node.llm->kv_memory());
+    }
+    return result;
+}
+
+std::string NumaRouter::send(const std::string& user_input, const std::string& image_path, const std::string& conversation_id, const LLM::Options& options) {
+    return send_async(user_input, nullptr, image_path, conversation_id, options).get().content;
+}
+
+std::future<LLM::Result> NumaRouter::send_async(const std::string& user_input, LLM::TokenCallback on_token, const std::string& image_path, const std::string& conversation_id, const LLM::Options& options) {
+    if (nodes.empty()) {
+        LOGe("send(): model is not loaded");
+        std::promise<LLM::Result> result;
+        result.set_value(LLM::error_result("the model is not loaded", false));
+        return result.get_future();
+    }
+    return route(conversation_id).llm->send_async(user_input, std::move(on_token), image_path, conversation_id, options);
+}
+
+bool NumaRouter::embed(const std::vector<std::string>& inputs, std::vector<std::vector<float>>& embeddings, int& n_tokens, std::string& error, bool& bad_request) {
+    if (nodes.empty()) {
+        error = "the model is not loaded";
+        bad_request = false;
+        return false;
+    }
+    size_t node;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        node = next_embed_node++ % nodes.size();
+    }
+    return nodes[node].llm->embed(inputs, embeddings, n_tokens, error, bad_request);
+}
+
+void NumaRouter::forget(const std::string& conversation_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    conversation_node.erase(conversation_id);
+}
+
+NumaRouter::Node& NumaRouter::route(const std::string& conversation_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    const int64_t now = llama_time_us();
+    // Routes the nodes never reported, e.g. of requests that failed before reaching a scheduler,
+    // go once they are older than any conversation can be
+    if (conversation_ttl > 0 && now - t_pruned >= 1000000) {
+        t_pruned = now;
+        for (auto it = conversation_node.begin(); it != conversation_node.end();) {
+            it = now - it->second.t_last_used >= conversation_ttl ? conversation_node.erase(it) : std::next(it);
+        }
+    }
+    if (!conversation_id.empty()) {
+        auto it = conversation_node.find(conversation_id);
+        if (it != conversation_node.end()) {
+            it->second.t_last_used = now;
+            return nodes[it->second.node];
+        }
+    }
+
+    size_t best = 0;
+    for (size_t i = 1; i < nodes.size(); i++) {
+        if (nodes[i].llm->pending() < nodes[best].llm->pending()) {
+            best = i;
+        }
+    }
+    if (!conversation_id.empty()) {
+        conversation_node[conversation_id] = {best, now};
+    }
+    return nodes[best];
+}
+
+size_t NumaRouter::node_count(const LLMConfig& config) {
+    if (config.numa != "distribute" && config.numa != "isolate") {
+        return 1;
+    }
+    return std::max<size_t>(1, node_cpus().size());
+}
+
+std::map<int, std::vector<int>> NumaRouter::node_cpus() {
+    std::map<int, std::vector<int>> result;
+    std::error_code ec;
+    for (fs::directory_iterator it("/sys/devices/system/node", ec), end; !ec && it != end; it.increment(ec)) {
+        const std::string name = it->path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+            continue;
+        }
+
+        // cpulist looks like "0-15,32-47", memory-only nodes have an empty one
+        std::ifstream in(it->path() / "cpulist");
+        std::string list;
+        std::getline(in, list);
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            int first = 0, last = 0;
+            int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (n < 1) {
+                continue;
+            }
+            for (int cpu = first; cpu <= (n == 2 ? last : first); cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            result[std::stoi(name.substr(4))] = cpus;
+        }
+    }
+    return result;
+}
+
+std::string NumaRouter::cpu_mask(const std::vector<int>& cpus) {
+    // Hex digits from the highest CPU down, the format of LLMConfig::cpu_mask
+    const int n_cpus = std::min(*std::max_element(cpus.begin(), cpus.end()) + 1, GGML_MAX_N_THREADS);
+    std::vector<int> digits((n_cpus + 3) / 4, 0);
+    for (int cpu : cpus) {
+        if (cpu < n_cpus) {
+            digits[cpu / 4] |= 1 << (cpu % 4);
+        }
+    }
+    std::string mask = "0x";
+    for (auto it = digits.rbegin(); it != digits.rend(); ++it) {
+        mask += "0123456789abcdef"[*it];
+    }
+    return mask;
+}
@@ -0,0 +1,73 @@
+#ifndef NUMA_ROUTER_H
+#define NUMA_ROUTER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include "LLM.h"
+#include "llm_config.h"
+
+// Front of the model server on NUMA hosts. With the distribute or isolate strategy every node gets
+// its own LLM: the weights are read into memory by a thread pinned to the node, the KV cache is
+// allocated there and both threadpools are pinned to the node's CPUs, so decoding never crosses
+// the interconnect. A conversation stays on the node that holds its KV, one-shot requests and new
+// conversations go to the node with the fewest pending requests. Without NUMA there is one node.
+class NumaRouter {
+public:
+    ~NumaRouter();
+
+    bool load(const LLMConfig& config);
+    void unload();
+    // All nodes share the directory, a conversation resumed on another node after a restart still
+    // finds its snapshot
+    bool enable_snapshots(const std::string& dir, uint64_t max_bytes);
+
+    std::string send(const std::string& user_input, const std::string& image_path = "", const std::string& conversation_id = "", const LLM::Options& options = LLM::Options());
+    std::future<LLM::Result> send_async(const std::string& user_input, LLM::TokenCallback on_token, const std::string& image_path = "", const std::string& conversation_id = "", const LLM::Options& options = LLM::Options());
+
+    // Embeddings mode, every call runs on one node, in turn
+    bool embed(const std::vector<std::string>& inputs, std::vector<std::vector<float>>& embeddings, int& n_tokens, std::string& error, bool& bad_request);
+
+    size_t size() const { return nodes.size(); }
+    // Requests queued or generating on all nodes
+    int pending() const;
+    uint64_t memory_bytes() const;
+    // Every node loads the same adapters
+    std::vector<std::string> lora_names() const { return nodes.empty() ? std::vector<std::string>() : nodes[0].llm->lora_names(); }
+    // Instances load() creates for config
+    static size_t node_count(const LLMConfig& config);
+    // KV accounting of every node
+    std::vector<KVMemory> kv_memory() const;
+
+private:
+    struct Node {
+        int id = -1;                // NUMA node, -1 when not pinned
+        std::vector<int> cpus;
+        std::unique_ptr<LLM> llm;
+    };
+
+    std::vector<Node> nodes;
+    std::mutex mtx;
+    // Node of each conversation, dropped when the node forgets the conversation or after
+    // conversation_ttl without a request
+    struct Route {
+        size_t node;
+        int64_t t_last_used;
+    };
+    std::map<std::string, Route> conversation_node;
+    int64_t conversation_ttl = 0;   // us, 0 for no limit
+    int64_t t_pruned = 0;
+    size_t next_embed_node = 0;
+
+    Node& route(const std::string& conversation_id);
+    void forget(const std::string& conversation_id);
+
+    // CPUs of every NUMA node by node id from sysfs, empty if the host does not report any
+    static std::map<int, std::vector<int>> node_cpus();
+    static std::string cpu_mask(const std::vector<int>& cpus);
+};
+
+#endif // NUMA_ROUTER_H
@@ -0,0 +1,279 @@
+#include "trace.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+
+#define LOGi(...) printf(__VA_ARGS__); printf("\n")
+#define LOGe(...) printf(__VA_ARGS__); printf("\n")
+
+namespace trace {
+
+std::atomic<int> runtime_level(LEVEL_OFF);
+
+namespace {
+
+struct PhaseInfo {
+    const char* name;
+    const char* arg_a;
+    const char* arg_b;
+};
+
+const PhaseInfo PHASES[PHASE_COUNT] = {
+    {"template_render", "prompt_chars", "messages"},
+    {"tokenize",        "n_tokens",     "n_chars"},
+    {"prefill_chunk",   "n_tokens",     "n_prompt_done"},
+    {"decode_step",     "n_tokens",     "n_decoding"},
+    {"sample",          "token",        "n_candidates"},
+    {"detokenize",      "token",        "n_bytes"},
+    {"draft",           "n_drafted",    "n_slots"},
+    {"verify",          "n_drafted",    "n_accepted"},
+    {"context_shift",   "n_discard",    "n_keep"},
+    {"request",         "n_prompt",     "n_decoded"},
+    {"image_encode",    "n_tokens",     "cached"},
+    {"image_decode",    "n_pos",        "n_past"},
+};
+
+struct Event {
+    uint64_t t_start;
+    uint64_t t_end;
+    int64_t a;
+    int64_t b;
+    uint16_t phase;
+    int16_t slot;
+};
+
+// Single producer (the owning thread), single consumer (the flusher)
+struct Ring {
+    static constexpr uint64_t CAPACITY = 1 << 14;
+    Event events[CAPACITY];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    int tid = 0;
+    std::string name;
+    bool name_written = false;
+    bool retired = false;   // the owning thread exited, freed once drained
+};
+
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<Ring>> rings;
+int next_tid = 1;
+bool draining = false;  // a flusher may hold pointers to the rings, retired ones are left to it
+
+void free_ring(Ring* r) {
+    for (auto it = rings.begin(); it != rings.end(); ++it) {
+        if (it->get() == r) {
+            rings.erase(it);
+            return;
+        }
+    }
+}
+
+// The calling thread's ring, created by the first event it records while tracing is on. A thread
+// that never traces only keeps its name
+struct LocalRing {
+    Ring* ring = nullptr;
+    std::string name;
+
+    ~LocalRing() {
+        if (!ring) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        if (draining) {
+            ring->retired = true;
+        } else {
+            free_ring(ring);
+        }
+    }
+};
+thread_local LocalRing local;
+
+std::mutex flusher_mutex;
+std::condition_variable flusher_cv;
+std::thread flusher;
+bool flusher_running = false;
+FILE* out = nullptr;
+bool first_event = true;
+uint64_t t_origin = 0;
+
+Ring* ring() {
+    if (!local.ring) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        rings.emplace_back(new Ring());
+        local.ring = rings.back().get();
+        local.ring->tid = next_tid++;
+        local.ring->name = local.name;
+    }
+    return local.ring;
+}
+
+void write_event(const Ring& r, const Event& e) {
+    const PhaseInfo& info = PHASES[e.phase];
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"llm\",\"ph\":\"%s\",\"ts\":%.3f,", first_event ? "" : ",\n",
+            info.name, e.t_end > e.t_start ? "X" : "i", (e.t_start - t_origin) / 1000.0);
+    if (e.t_end > e.t_start) {
+        fprintf(out, "\"dur\":%.3f,", (e.t_end - e.t_start) / 1000.0);
+    } else {
+        fprintf(out, "\"s\":\"t\",");
+    }
+    fprintf(out, "\"pid\":1,\"tid\":%d,\"args\":{\"slot\":%d,\"%s\":%lld,\"%s\":%lld}}", r.tid, e.slot,
+            info.arg_a, (long long) e.a, info.arg_b, (long long) e.b);
+    first_event = false;
+}
+
+void drain() {
+    std::vector<Ring*> snapshot;
+    std::vector<Ring*> retired;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (auto& r : rings) {
+            snapshot.push_back(r.get());
+            if (r->retired) {
+                retired.push_back(r.get());
+            }
+            if (out && !r->name_written && !r->name.empty()) {
+                fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        first_event ? "" : ",\n", r->tid, r->name.c_str());
+                first_event = false;
+                r->name_written = true;
+            }
+        }
+    }
+
+    for (Ring* r : snapshot) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        const uint64_t head = r->head.load(std::memory_order_acquire);
+        for (; tail < head; tail++) {
+            if (out) {
+                write_event(*r, r->events[tail & (Ring::CAPACITY - 1)]);
+            }
+        }
+        r->tail.store(tail, std::memory_order_release);
+
+        const uint64_t dropped = r->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            LOGe("trace: thread %d dropped %llu events", r->tid, (unsigned long long) dropped);
+        }
+    }
+    if (out) {
+        fflush(out);
+    }
+
+    // Their threads are gone, nothing is written to them after the drain above
+    if (!retired.empty()) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (Ring* r : retired) {
+            free_ring(r);
+        }
+    }
+}
+
+void flusher_loop() {
+    std::unique_lock<std::mutex> lock(flusher_mutex);
+    while (flusher_running) {
+        flusher_cv.wait_for(lock, std::chrono::milliseconds(100));
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+}
+
+} // namespace
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool start(int level, const std::string& path) {
+    if (flusher.joinable() || level <= LEVEL_OFF) {
+        return false;
+    }
+    out = fopen(path.c_str(), "w");
+    if (!out) {
+        LOGe("trace: cannot open %s", path.c_str());
+        return false;
+    }
+    // JSON array format, the closing bracket is optional for trace viewers
+    fprintf(out, "[\n");
+    first_event = true;
+    t_origin = now_ns();
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        draining = true;
+    }
+
+    flusher_running = true;
+    flusher = std::thread(flusher_loop);
+    set_level(level);
+    LOGi("trace: level %d, writing %s", level, path.c_str());
+    return true;
+}
+
+void stop() {
+    set_level(LEVEL_OFF);
+    if (!flusher.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(flusher_mutex);
+        flusher_running = false;
+    }
+    flusher_cv.notify_all();
+    flusher.join();
+    drain();
+    {
+        // Threads that exit from now on free their rings themselves
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        draining = false;
+        for (size_t i = 0; i < rings.size();) {
+            if (rings[i]->retired) {
+                rings.erase(rings.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+    fprintf(out, "\n]\n");
+    fclose(out);
+    out = nullptr;
+}
+
+void set_level(int level) {
+    runtime_level.store(level > LLM_TRACE_LEVEL ? LLM_TRACE_LEVEL : level, std::memory_order_relaxed);
+}
+
+void set_thread_name(const std::string& name) {
+    local.name = name;
+    if (local.ring) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        local.ring->name = name;
+    }
+}
+
+void record(Phase phase, int slot, uint64_t t_start, uint64_t t_end, int64_t a, int64_t b) {
+    // A scope that started before stop() is not worth a ring
+    if (!local.ring && runtime_level.load(std::memory_order_relaxed) == LEVEL_OFF) {
+        return;
+    }
+    Ring* r = ring();
+    const uint64_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= Ring::CAPACITY) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Event& e = r->events[head & (Ring::CAPACITY - 1)];
+    e.t_start = t_start;
+    e.t_end = t_end;
+    e.a = a;
+    e.b = b;
+    e.phase = phase;
+    e.slot = slot;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+} // namespace trace
@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <cstdint>
+#include <atomic>
+
+// Events above this level are compiled out, the runtime level filters the rest
+#ifndef LLM_TRACE_LEVEL
+#define LLM_TRACE_LEVEL 3
+#endif
+
+// Structured tracing for the hot paths. Every thread records into its own lock-free ring buffer,
+// a background thread drains them into a Chrome trace file (chrome://tracing, Perfetto). Recording
+// an event is a clock read and a few stores, nothing on the calling thread touches I/O; events are
+// dropped, and counted, when a ring is full.
+namespace trace {
+
+enum Level {
+    LEVEL_OFF     = 0,
+    LEVEL_REQUEST = 1,  // once per request
+    LEVEL_STEP    = 2,  // once per scheduler step
+    LEVEL_TOKEN   = 3,  // once per token and slot
+};
+
+enum Phase : uint16_t {
+    TEMPLATE_RENDER,
+    TOKENIZE,
+    PREFILL_CHUNK,
+    DECODE_STEP,
+    SAMPLE,
+    DETOKENIZE,
+    DRAFT,
+    VERIFY,
+    CONTEXT_SHIFT,
+    REQUEST,
+    IMAGE_ENCODE,
+    IMAGE_DECODE,
+    PHASE_COUNT,
+};
+
+extern std::atomic<int> runtime_level;
+
+// Starts the flusher writing to path, level is the runtime level
+bool start(int level, const std::string& path);
+// Drains what is left and closes the file
+void stop();
+void set_level(int level);
+inline bool enabled(int level) { return level <= runtime_level.load(std::memory_order_relaxed); }
+
+// Names the calling thread in the exported trace
+void set_thread_name(const std::string& name);
+
+uint64_t now_ns();
+void record(Phase phase, int slot, uint64_t t_start, uint64_t t_end, int64_t a, int64_t b);
+
+template <int Level>
+inline void instant(Phase phase, int slot, int64_t a = 0, int64_t b = 0) {
+    if (Level <= LLM_TRACE_LEVEL && enabled(Level)) {
+        uint64_t t = now_ns();
+        record(phase, slot, t, t, a, b);
+    }
+}
+
+// Records the lifetime of the scope as one event, a and b are the phase's arguments
+template <int Level, bool = (Level <= LLM_TRACE_LEVEL)>
+class Scope {
+public:
+    Scope(Phase phase, int slot) : phase(phase), slot(slot), t_start(enabled(Level) ? now_ns() : 0) {}
+    ~Scope() {
+        if (t_start) {
+            record(phase, slot, t_start, now_ns(), a, b);
+        }
+    }
+    int64_t a = 0;
+    int64_t b = 0;
+
+private:
+    Phase phase;
+    int slot;
+    uint64_t t_start;
+};
+
+template <int Level>
+class Scope<Level, false> {
+public:
+    Scope(Phase, int) {}
+    int64_t a = 0;
+    int64_t b = 0;
+};
+
+} // namespace trace
+
+#endif // TRACE_H
@@ -0,0 +1,61 @@
+#include "vision_cache.h"
+#include <cstdio>
+
+VisionCache::VisionCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+void VisionCache::set_budget(size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mtx);
+    this->max_bytes = max_bytes;
+    evict();
+}
+
+std::string VisionCache::key(const mtmd_bitmap* bitmap) {
+    // FNV-1a over the dimensions and the pixels, a few ms for a full-page screenshot, nothing
+    // next to encoding it
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](const unsigned char* data, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            hash = (hash ^ data[i]) * 1099511628211ULL;
+        }
+    };
+    const uint32_t dims[2] = {mtmd_bitmap_get_nx(bitmap), mtmd_bitmap_get_ny(bitmap)};
+    mix(reinterpret_cast<const unsigned char*>(dims), sizeof(dims));
+    mix(mtmd_bitmap_get_data(bitmap), mtmd_bitmap_get_n_bytes(bitmap));
+
+    char buf[40];
+    snprintf(buf, sizeof(buf), "img-%016llx-%zu", (unsigned long long) hash, mtmd_bitmap_get_n_bytes(bitmap));
+    return buf;
+}
+
+std::shared_ptr<const std::vector<float>> VisionCache::get(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        n_misses++;
+        return nullptr;
+    }
+    n_hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->embd;
+}
+
+void VisionCache::put(const std::string& key, std::shared_ptr<const std::vector<float>> embd) {
+    const size_t size = embd->size() * sizeof(float);
+    std::lock_guard<std::mutex> lock(mtx);
+    if (key.empty() || size > max_bytes || index.count(key)) {
+        return;
+    }
+    lru.push_front({key, std::move(embd)});
+    index[key] = lru.begin();
+    n_bytes += size;
+    evict();
+}
+
+void VisionCache::evict() {
+    while (n_bytes > max_bytes && !lru.empty()) {
+        const Entry& entry = lru.back();
+        n_bytes -= entry.embd->size() * sizeof(float);
+        index.erase(entry.key);
+        lru.pop_back();
+    }
+}
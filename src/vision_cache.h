@@ -0,0 +1,52 @@
+#ifndef VISION_CACHE_H
+#define VISION_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "mtmd.h"
+
+// Encoded image embeddings by content hash. Request images are tagged with key() through
+// mtmd_bitmap_set_id, the image chunks mtmd_tokenize makes from them carry the same id, and the
+// entries are stored under that id plus the chunk's ordinal, one per slice of a sliced image. An
+// image seen before is decoded from its cached embeddings without running the vision encoder. The
+// least recently used entries are dropped to stay under max_bytes. Thread-safe.
+class VisionCache {
+public:
+    explicit VisionCache(size_t max_bytes = 256u << 20);
+
+    void set_budget(size_t max_bytes);
+    // Size and pixels of the bitmap hashed, stable across requests and processes
+    static std::string key(const mtmd_bitmap* bitmap);
+
+    // Embedding of the image chunk with this key, nullptr if it is not cached. The entry stays
+    // valid while the caller holds it, even if it is evicted meanwhile
+    std::shared_ptr<const std::vector<float>> get(const std::string& key);
+    void put(const std::string& key, std::shared_ptr<const std::vector<float>> embd);
+
+    uint64_t hits() const { return n_hits; }
+    uint64_t misses() const { return n_misses; }
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const std::vector<float>> embd;
+    };
+
+    size_t max_bytes;
+    size_t n_bytes = 0;
+    std::atomic<uint64_t> n_hits{0};
+    std::atomic<uint64_t> n_misses{0};
+    std::list<Entry> lru;   // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::mutex mtx;
+
+    void evict();
+};
+
+#endif // VISION_CACHE_H
@@ -0,0 +1,45 @@
+#include "worker_pool.h"
+#include "trace.h"
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::start(int n_threads, const std::string& name) {
+    if (!threads.empty()) {
+        return;
+    }
+    running = true;
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back(&WorkerPool::loop, this, name + "/" + std::to_string(i));
+    }
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        running = false;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+void WorkerPool::loop(const std::string& name) {
+    trace::set_thread_name(name);
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this] { return !running || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+
+// Fixed set of threads running submitted jobs in order of submission. Used for the CPU work around
+// a request that does not need the llama context, such as decoding images, so it overlaps with the
+// scheduler instead of stalling it.
+class WorkerPool {
+public:
+    WorkerPool() = default;
+    ~WorkerPool();
+
+    // name shows up in traces as "name/<index>"
+    void start(int n_threads, const std::string& name);
+    // Runs the jobs already queued, then joins the threads
+    void stop();
+    bool started() const { return !threads.empty(); }
+
+    template <typename F>
+    auto submit(F&& job) -> std::future<decltype(job())> {
+        using R = decltype(job());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(job));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs.emplace_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running = false;
+
+    void loop(const std::string& name);
+};
+
+#endif // WORKER_POOL_H